@@ -0,0 +1,863 @@
+// Benchmark harness for shell24's hot paths. shell24.c is compiled into this program so
+// the shell's own functions are timed directly. Results are printed as one JSON document.
+//
+// Usage: shell24_bench [--quick] [benchmark...]
+//   benchmarks: launch parse pipeline concat ring fanout rss glob history newt subst redir buffers serve (default: all)
+//        shell24_bench --soak [LINES]
+
+#define main shell24_main
+#include "../shell24.c"
+#undef main
+
+#include <sys/resource.h>
+
+int quickMode = 0;     // --quick: smaller inputs and fewer iterations
+int firstResult = 1;   // Comma handling for the top-level JSON object
+char benchDir[] = "/tmp/shell24_bench_XXXXXX";
+
+double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Percentile of an already sorted array
+double percentile(double* values, int count, double p) {
+    int index = (int)(p / 100.0 * (count - 1) + 0.5);
+    return values[index];
+}
+
+// Starts the next top-level "name": value entry of the JSON output
+void beginResult(const char* name) {
+    printf("%s\n  \"%s\": ", firstResult ? "{" : ",", name);
+    firstResult = 0;
+}
+
+// Parses one line into commands using the per-line arena (reset by the caller)
+Command* parseForBench(const char* line, int* count) {
+    Token* tokens;
+    int tokenCount = lexCommandLine(&lineArena, line, strlen(line), &tokens);
+    Command* commands = NULL;
+    *count = tokenCount > 0 ? parseCommandLine(&lineArena, tokens, tokenCount, &commands) : 0;
+    return commands;
+}
+
+// Creates a file of the given size filled with text lines
+void makeDataFile(const char* path, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char line[4096];
+    for (size_t i = 0; i < sizeof(line); i++) line[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+    for (size_t done = 0; done < size; done += sizeof(line)) {
+        writeAll(fd, line, size - done < sizeof(line) ? size - done : sizeof(line));
+    }
+    close(fd);
+}
+
+// Command latency through executeSingleCommand: /bin/true with both launch paths, and the
+// in-process 'true' builtin
+void benchLaunch() {
+    int iterations = quickMode ? 200 : 2000;
+    double* samples = malloc(iterations * sizeof(double));
+    const char* modes[] = {"spawn", "fork", "builtin"};
+
+    beginResult("launch");
+    printf("{\"command\": \"true\", \"iterations\": %d", iterations);
+    for (int m = 0; m < 3; m++) {
+        launchMode = (m == 1) ? LAUNCH_FORK : LAUNCH_SPAWN;
+        int count;
+        Command* cmd = parseForBench(m == 2 ? "true" : "/bin/true", &count);
+        for (int i = 0; i < iterations; i++) {
+            double start = nowSeconds();
+            executeSingleCommand(cmd, 1, 0);
+            samples[i] = (nowSeconds() - start) * 1e6;
+        }
+        arenaReset(&lineArena);
+        qsort(samples, iterations, sizeof(double), compareDoubles);
+        printf(", \"%s\": {\"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}", modes[m],
+               percentile(samples, iterations, 50), percentile(samples, iterations, 99),
+               samples[iterations - 1]);
+    }
+    printf("}");
+    launchMode = LAUNCH_SPAWN;
+    free(samples);
+}
+
+// Lexer + parser throughput on synthetic lines of different shapes and sizes, and the
+// rate at which a repeated line is served from the plan cache instead
+void benchParse() {
+    double budget = quickMode ? 0.1 : 0.5; // Seconds per line shape
+    char* longLine = malloc(100 * 1024 + 64);
+    char* p = longLine;
+    while (p - longLine < 100 * 1024) p += sprintf(p, "cmd%d --opt=\"a b\" x\\|y | ", (int)(p - longLine) % 97);
+    strcpy(p, "tail -n 1");
+
+    struct { const char* name; const char* line; } shapes[] = {
+        {"short", "ls -l -t | grep foo && echo ok"},
+        {"mixed", "cat 'a file.txt' < in.txt | sort -r | uniq -c > out.txt ; date || echo \"fail here\" && ~/bin/x &"},
+        {"long_100k", longLine},
+    };
+
+    beginResult("parse");
+    printf("[");
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        size_t len = strlen(shapes[s].line);
+        long lines = 0;
+        double start = nowSeconds(), elapsed;
+        do {
+            for (int i = 0; i < 64; i++) {
+                int count;
+                parseForBench(shapes[s].line, &count);
+                arenaReset(&lineArena);
+            }
+            lines += 64;
+            elapsed = nowSeconds() - start;
+        } while (elapsed < budget);
+        printf("%s{\"shape\": \"%s\", \"bytes\": %zu, \"lines_per_s\": %.0f, \"mb_per_s\": %.1f",
+               s ? ", " : "", shapes[s].name, len, lines / elapsed, lines * len / elapsed / 1e6);
+
+        // The same line again, as executeLine gets it: its plan comes from the cache
+        if (len <= PLAN_CACHE_MAX_LINE) {
+            int status;
+            lines = 0;
+            start = nowSeconds();
+            do {
+                for (int i = 0; i < 64; i++) planForLine(shapes[s].line, &status);
+                lines += 64;
+                elapsed = nowSeconds() - start;
+            } while (elapsed < budget);
+            printf(", \"cached_lines_per_s\": %.0f", lines / elapsed);
+        }
+        printf("}");
+    }
+    printf("]");
+    free(longLine);
+}
+
+// Pipeline throughput through handlePipedCommands: cat FILE | cat | ... | cat > /dev/null
+void benchPipeline() {
+    size_t size = quickMode ? (16 << 20) : (256 << 20);
+    char path[64], line[4096];
+    snprintf(path, sizeof(path), "%s/pipe.dat", benchDir);
+    makeDataFile(path, size);
+    int stageCounts[] = {2, 4, 8, 16};
+
+    beginResult("pipeline");
+    printf("{\"bytes\": %zu, \"results\": [", size);
+    for (int s = 0; s < 4; s++) {
+        char* q = line + sprintf(line, "cat %s", path);
+        for (int i = 1; i < stageCounts[s]; i++) q += sprintf(q, " | cat");
+        sprintf(q, " > /dev/null");
+        int count;
+        Command* commands = parseForBench(line, &count);
+        double start = nowSeconds();
+        handlePipedCommands(commands, count, 0);
+        double elapsed = nowSeconds() - start;
+        arenaReset(&lineArena);
+        printf("%s{\"stages\": %d, \"mb_per_s\": %.1f}", s ? ", " : "", stageCounts[s], size / elapsed / 1e6);
+    }
+    printf("]}");
+    unlink(path);
+}
+
+// Runs concatenateFiles with stdout pointed at target and returns the elapsed time
+double timeConcatenation(char** files, int numFiles, int target) {
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    dup2(target, STDOUT_FILENO);
+    double start = nowSeconds();
+    concatenateFiles(files, numFiles);
+    double elapsed = nowSeconds() - start;
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    return elapsed;
+}
+
+// Sums a buffer a word at a time, so the consumer of a transport touches every byte
+uint64_t sumWords(const char* data, size_t len) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        sum += word;
+    }
+    return sum;
+}
+
+// Moves size bytes from one forked process to another through a pipe of the given
+// capacity (ring == NULL) or through ring, 64 KB per write; returns MB/s
+double transportThroughput(size_t size, size_t capacity, RingBuffer* ring) {
+    static char chunk[65536];
+    int pd[2] = {-1, -1};
+    if (!ring) {
+        if (pipe2(pd, O_CLOEXEC) < 0) return 0;
+        fcntl(pd[1], F_SETPIPE_SZ, (int)capacity);
+    }
+    double start = nowSeconds();
+    pid_t producer = fork();
+    if (producer == 0) {
+        if (ring) {
+            close(ring->aliveRead);
+            for (size_t done = 0; done < size;) {
+                size_t left = size - done < sizeof(chunk) ? size - done : sizeof(chunk);
+                size_t len;
+                char* span = ringWriteSpan(ring, &len);
+                if (span == NULL) _exit(1);
+                if (len > left) len = left;
+                memcpy(span, chunk, len);
+                commitRingWrite(ring, len, 0);
+                done += len;
+            }
+        } else {
+            close(pd[0]);
+            for (size_t done = 0; done < size; done += sizeof(chunk)) writeAll(pd[1], chunk, sizeof(chunk));
+        }
+        _exit(0);
+    }
+    pid_t consumer = fork();
+    if (consumer == 0) {
+        uint64_t sum = 0;
+        if (ring) {
+            close(ring->aliveWrite);
+            size_t len;
+            char* span;
+            while ((span = ringReadSpan(ring, &len)) != NULL) {
+                sum += sumWords(span, len);
+                commitRingRead(ring, len);
+            }
+        } else {
+            close(pd[1]);
+            char buffer[65536];
+            ssize_t n;
+            while ((n = read(pd[0], buffer, sizeof(buffer))) > 0) sum += sumWords(buffer, n);
+        }
+        _exit(sum == 1); // Keeps the sum from being optimized away
+    }
+    if (ring) {
+        closeRing(ring);
+    } else {
+        close(pd[0]);
+        close(pd[1]);
+    }
+    waitpid(producer, NULL, 0);
+    waitpid(consumer, NULL, 0);
+    return size / (nowSeconds() - start) / 1e6;
+}
+
+// Pipe against shared-memory ring between two processes at several capacities, and
+// 'cat FILE | cat | cat > /dev/null' with 'set ringsize' at those capacities and 0 (pipes)
+void benchRing() {
+    size_t size = quickMode ? (64 << 20) : (1024L << 20);
+    size_t capacities[] = {64 << 10, 256 << 10, 1 << 20, 4 << 20};
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "%s/ring.dat", benchDir);
+    makeDataFile(path, size / 4);
+    snprintf(line, sizeof(line), "cat %s | cat | cat > /dev/null", path);
+    long savedRingSize = ringSize;
+    fflush(stdout);
+
+    beginResult("ring");
+    printf("{\"bytes\": %zu, \"pipeline_bytes\": %zu, \"results\": [", size, size / 4);
+    for (int c = 0; c < 5; c++) {
+        size_t capacity = c < 4 ? capacities[c] : 0;
+        if (c < 4) {
+            double pipeRate = transportThroughput(size, capacity, NULL);
+            double ringRate = transportThroughput(size, capacity, createRing(&lineArena, capacity));
+            printf("%s{\"capacity\": %zu, \"pipe_mb_per_s\": %.1f, \"ring_mb_per_s\": %.1f", c ? ", " : "",
+                   capacity, pipeRate, ringRate);
+        } else {
+            printf(", {\"capacity\": 0"); // Pipes only
+        }
+        ringSize = capacity;
+        int count;
+        Command* commands = parseForBench(line, &count);
+        double start = nowSeconds();
+        handlePipedCommands(commands, count, 0);
+        double elapsed = nowSeconds() - start;
+        arenaReset(&lineArena);
+        printf(", \"cat_pipeline_mb_per_s\": %.1f}", size / 4 / elapsed / 1e6);
+    }
+    printf("]}");
+    ringSize = savedRingSize;
+    unlink(path);
+}
+
+// '#' concatenation throughput into a regular file, a pipe and /dev/null
+void benchConcat() {
+    size_t fileSize = quickMode ? (8 << 20) : (128 << 20);
+    char* files[4];
+    for (int i = 0; i < 4; i++) {
+        files[i] = malloc(64);
+        snprintf(files[i], 64, "%s/part%d.dat", benchDir, i);
+        makeDataFile(files[i], fileSize);
+    }
+    size_t total = fileSize * 4;
+
+    beginResult("concat");
+    printf("{\"files\": 4, \"bytes\": %zu", total);
+
+    char outPath[64];
+    snprintf(outPath, sizeof(outPath), "%s/concat.out", benchDir);
+    int outFd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    printf(", \"regular_file_mb_per_s\": %.1f", total / timeConcatenation(files, 4, outFd) / 1e6);
+    close(outFd);
+    unlink(outPath);
+
+    // A child drains the pipe like a downstream command would
+    int pd[2];
+    pipe(pd);
+    pid_t reader = fork();
+    if (reader == 0) {
+        close(pd[1]);
+        char buf[65536];
+        while (read(pd[0], buf, sizeof(buf)) > 0) ;
+        _exit(0);
+    }
+    close(pd[0]);
+    double elapsed = timeConcatenation(files, 4, pd[1]);
+    close(pd[1]);
+    waitpid(reader, NULL, 0);
+    printf(", \"pipe_mb_per_s\": %.1f", total / elapsed / 1e6);
+
+    int devNull = open("/dev/null", O_WRONLY);
+    printf(", \"dev_null_mb_per_s\": %.1f}", total / timeConcatenation(files, 4, devNull) / 1e6);
+    close(devNull);
+
+    for (int i = 0; i < 4; i++) {
+        unlink(files[i]);
+        free(files[i]);
+    }
+}
+
+// '>|' fan-out against the same copies made by tee(1): cat FILE >| f1 >| f2 > /dev/null
+void benchFanOut() {
+    size_t size = quickMode ? (16 << 20) : (256 << 20);
+    char path[64], copies[2][64], line[512];
+    snprintf(path, sizeof(path), "%s/fanout.dat", benchDir);
+    snprintf(copies[0], 64, "%s/fanout1.out", benchDir);
+    snprintf(copies[1], 64, "%s/fanout2.out", benchDir);
+    makeDataFile(path, size);
+    const char* forms[][2] = {
+        {"fanout", "cat %s >| %s >| %s > /dev/null"},
+        {"tee", "cat %s | tee %s %s > /dev/null"},
+    };
+
+    beginResult("fanout");
+    printf("{\"bytes\": %zu, \"copies\": 2", size);
+    for (int f = 0; f < 2; f++) {
+        snprintf(line, sizeof(line), forms[f][1], path, copies[0], copies[1]);
+        int count;
+        Command* commands = parseForBench(line, &count);
+        double start = nowSeconds();
+        handlePipedCommands(commands, count, 0);
+        double elapsed = nowSeconds() - start;
+        arenaReset(&lineArena);
+        printf(", \"%s_mb_per_s\": %.1f", forms[f][0], size / elapsed / 1e6);
+    }
+    printf("}");
+    unlink(path);
+    unlink(copies[0]);
+    unlink(copies[1]);
+}
+
+// Glob cost against directory size: the first expansion lists the directory, later ones
+// reuse the cached listing while the directory is unchanged
+void benchGlob() {
+    int sizes[] = {1000, 10000, 100000};
+    int sizeCount = quickMode ? 2 : 3;
+    int repeats = quickMode ? 20 : 50;
+    char path[128];
+
+    beginResult("glob");
+    printf("[");
+    for (int s = 0; s < sizeCount; s++) {
+        char dir[64], pattern[96];
+        snprintf(dir, sizeof(dir), "%s/glob%d", benchDir, sizes[s]);
+        mkdir(dir, 0755);
+        for (int i = 0; i < sizes[s]; i++) {
+            snprintf(path, sizeof(path), "%s/file%06d.%s", dir, i, i % 10 == 7 ? "c" : "o");
+            close(open(path, O_WRONLY | O_CREAT, 0644));
+        }
+        snprintf(pattern, sizeof(pattern), "%s/*7.c", dir);
+        usleep(GLOB_RACY_NS / 1000 * 2); // Listings are only reused once the mtime is this old
+
+        flushDirCache();
+        GlobResult result = {&lineArena, NULL, 0, 0};
+        double start = nowSeconds();
+        int matches = expandGlob(&result, pattern);
+        double coldSeconds = nowSeconds() - start;
+
+        double* cached = malloc(repeats * sizeof(double));
+        for (int r = 0; r < repeats; r++) {
+            result.count = 0;
+            arenaReset(&lineArena);
+            start = nowSeconds();
+            expandGlob(&result, pattern);
+            cached[r] = nowSeconds() - start;
+        }
+        qsort(cached, repeats, sizeof(double), compareDoubles);
+        printf("%s{\"entries\": %d, \"matches\": %d, \"scan_ms\": %.2f, \"cached_p50_ms\": %.2f}",
+               s ? ", " : "", sizes[s], matches, coldSeconds * 1e3, percentile(cached, repeats, 50) * 1e3);
+        free(cached);
+        memFree(result.paths);
+        arenaReset(&lineArena);
+
+        for (int i = 0; i < sizes[s]; i++) {
+            snprintf(path, sizeof(path), "%s/file%06d.%s", dir, i, i % 10 == 7 ? "c" : "o");
+            unlink(path);
+        }
+        rmdir(dir);
+    }
+    printf("]");
+}
+
+// History with 4 shells appending at once, then the lookups 'history' answers from its index
+void benchHistory() {
+    int writers = 4;
+    int perWriter = quickMode ? 25000 : 500000;
+    char path[64];
+    snprintf(path, sizeof(path), "%s/history", benchDir);
+    setenv("SHELL24_HISTFILE", path, 1);
+
+    fflush(stdout);
+    double start = nowSeconds();
+    for (int w = 0; w < writers; w++) {
+        if (fork() == 0) {
+            char line[128];
+            for (int i = 0; i < perWriter; i++) {
+                snprintf(line, sizeof(line), "make -C build/w%d target%d && ./run-tests --shard %d", w, i, i % 97);
+                recordHistory(line);
+            }
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0) ;
+    double appendSeconds = nowSeconds() - start;
+    int total = writers * perWriter;
+
+    start = nowSeconds();
+    indexHistory();
+    double indexSeconds = nowSeconds() - start;
+
+    start = nowSeconds();
+    long found = findHistoryPrefix("make -C build/w2", 16);
+    double prefixSeconds = nowSeconds() - start;
+
+    // Substring search as 'history -s' runs it, without printing the matches
+    start = nowSeconds();
+    const char* needle = "target12345 ";
+    HistoryBucket* bucket = historyCandidates(needle, strlen(needle));
+    uint32_t count = bucket ? bucket->count : history.count;
+    int matches = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t len;
+        const char* text = historyText(bucket ? bucket->entries[i] : i, &len);
+        if (memmem(text, len, needle, strlen(needle))) matches++;
+    }
+    double searchSeconds = nowSeconds() - start;
+
+    beginResult("history");
+    printf("{\"lines\": %d, \"indexed\": %u, \"append_ns\": %.0f, \"index_ms\": %.1f, "
+           "\"index_kb\": %zu, \"prefix_us\": %.1f, \"prefix_found\": %s, \"search_ms\": %.2f, \"search_matches\": %d}",
+           total, history.count, appendSeconds / perWriter * 1e9, indexSeconds * 1e3,
+           memUsage[MEM_HISTORY].liveBytes / 1024, prefixSeconds * 1e6, found >= 0 ? "true" : "false",
+           searchSeconds * 1e3, matches);
+    unlink(path);
+}
+
+// Time to start a 'newt' session (forkpty of this already-initialized shell) next to a bare
+// fork(), and the time until the session's first prompt can be read from its terminal
+void benchNewt() {
+    int iterations = quickMode ? 50 : 500;
+    double* forkSamples = malloc(iterations * sizeof(double));
+    double* newtSamples = malloc(iterations * sizeof(double));
+    double* readySamples = malloc(iterations * sizeof(double));
+    fflush(stdout);
+    for (int i = 0; i < iterations; i++) {
+        double start = nowSeconds();
+        pid_t pid = fork();
+        if (pid == 0) _exit(0);
+        forkSamples[i] = (nowSeconds() - start) * 1e6;
+        waitpid(pid, NULL, 0);
+
+        start = nowSeconds();
+        Session* session = startSession();
+        newtSamples[i] = (nowSeconds() - start) * 1e6;
+        struct pollfd fd = {session->masterFd, POLLIN, 0};
+        poll(&fd, 1, 5000);
+        readySamples[i] = (nowSeconds() - start) * 1e6;
+
+        kill(session->pid, SIGKILL);
+        waitpid(session->pid, NULL, 0);
+        sessionList = NULL;
+        freeSession(session);
+    }
+    qsort(forkSamples, iterations, sizeof(double), compareDoubles);
+    qsort(newtSamples, iterations, sizeof(double), compareDoubles);
+    qsort(readySamples, iterations, sizeof(double), compareDoubles);
+
+    beginResult("newt");
+    printf("{\"iterations\": %d, \"fork_p50_us\": %.1f, \"fork_p99_us\": %.1f, "
+           "\"newt_p50_us\": %.1f, \"newt_p99_us\": %.1f, \"ready_p50_us\": %.1f, \"ready_p99_us\": %.1f}",
+           iterations, percentile(forkSamples, iterations, 50), percentile(forkSamples, iterations, 99),
+           percentile(newtSamples, iterations, 50), percentile(newtSamples, iterations, 99),
+           percentile(readySamples, iterations, 50), percentile(readySamples, iterations, 99));
+    free(forkSamples);
+    free(newtSamples);
+    free(readySamples);
+}
+
+// Latency of building an argument list with '$(...)': a builtin run inside the shell, the
+// same output from an external program, and a 1 MB output split into words
+void benchSubst() {
+    int iterations = quickMode ? 200 : 2000;
+    char bigFile[96], bigLine[160];
+    snprintf(bigFile, sizeof(bigFile), "%s/subst_words", benchDir);
+    FILE* f = fopen(bigFile, "w");
+    for (int i = 0; f && ftell(f) < (1 << 20); i++) fprintf(f, "word%d\n", i);
+    if (f) fclose(f);
+    snprintf(bigLine, sizeof(bigLine), "true $(/bin/cat %s)", bigFile);
+    struct {
+        const char* name;
+        const char* line;
+        int iterations;
+    } cases[] = {
+        {"builtin", "true a$(echo hi there)b", iterations},
+        {"external", "true a$(/bin/echo hi there)b", iterations / 4},
+        {"nested", "true $(echo $(echo hi))", iterations},
+        {"words_1m", bigLine, iterations / 20},
+    };
+
+    beginResult("subst");
+    printf("[");
+    fflush(stdout);
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        Arena planArena = {NULL, ARENA_BLOCK_SIZE, MEM_PLANS};
+        Plan plan;
+        compileLine(&planArena, cases[c].line, strlen(cases[c].line), &plan);
+        Command* stage = plan.lists[0].pipelines[0].stages;
+        int count = cases[c].iterations;
+        double* samples = malloc(count * sizeof(double));
+        int words = 0;
+        for (int i = 0; i < count; i++) {
+            Command cmd = *stage;
+            double start = nowSeconds();
+            expandCommandSubstitutions(&lineArena, &cmd, 1);
+            samples[i] = (nowSeconds() - start) * 1e6;
+            words = cmd.argc - 1;
+            arenaReset(&lineArena);
+        }
+        qsort(samples, count, sizeof(double), compareDoubles);
+        printf("%s{\"case\": \"%s\", \"words\": %d, \"p50_us\": %.1f, \"p99_us\": %.1f}", c ? ", " : "",
+               cases[c].name, words, percentile(samples, count, 50), percentile(samples, count, 99));
+        fflush(stdout);
+        free(samples);
+        arenaFree(&planArena);
+    }
+    printf("]");
+    unlink(bigFile);
+}
+
+// Lines per second of 'echo ... >> LOG' run inside the shell, with every '>>' opening the
+// log's path and with the cached descriptor, and the cache's hit rate
+void benchRedir() {
+    long total = quickMode ? 20000 : 200000;
+    char dir[128], line[256];
+    snprintf(dir, sizeof(dir), "%s/a", benchDir);
+    for (int depth = 0; depth < 6; depth++) {
+        mkdir(dir, 0755);
+        strcat(dir, "/a");
+    }
+    snprintf(line, sizeof(line), "echo appended line >> %s.log", dir);
+
+    beginResult("redir");
+    double rates[2];
+    for (int cached = 0; cached < 2; cached++) {
+        redirCacheEnabled = cached;
+        flushRedirCache();
+        redirCache.hits = redirCache.misses = 0;
+        char copy[256];
+        double start = nowSeconds();
+        for (long i = 0; i < total; i++) {
+            strcpy(copy, line);
+            executeLine(copy);
+        }
+        rates[cached] = total / (nowSeconds() - start);
+    }
+    unsigned long lookups = redirCache.hits + redirCache.misses;
+    printf("{\"lines\": %ld, \"open_lines_per_s\": %.0f, \"cached_lines_per_s\": %.0f, \"hit_rate\": %.4f}",
+           total, rates[0], rates[1], lookups ? (double)redirCache.hits / lookups : 0.0);
+    flushRedirCache();
+    redirCacheEnabled = 1;
+    snprintf(line, sizeof(line), "%s.log", dir);
+    unlink(line);
+    // Only the levels created above; benchDir itself is removed by main
+    *strrchr(dir, '/') = '\0';
+    while (strlen(dir) > strlen(benchDir)) {
+        rmdir(dir);
+        *strrchr(dir, '/') = '\0';
+    }
+}
+
+// MB/s of a scratch round trip, 'cat SRC > T' then 'cat < T > /dev/null', with T a file
+// next to SRC and with T an '@name' buffer
+void benchBuffers() {
+    size_t size = quickMode ? (16 << 20) : (256 << 20);
+    int repeats = quickMode ? 2 : 5;
+    char source[64], scratch[64];
+    snprintf(source, sizeof(source), "%s/scratch_src.dat", benchDir);
+    snprintf(scratch, sizeof(scratch), "%s/scratch.dat", benchDir);
+    makeDataFile(source, size);
+    const char* targets[] = {scratch, "@scratch"};
+    const char* names[] = {"file", "buffer"};
+
+    beginResult("buffers");
+    printf("{\"bytes\": %zu", size);
+    for (int t = 0; t < 2; t++) {
+        char writeLine[192], readLine[192];
+        snprintf(writeLine, sizeof(writeLine), "cat %s > %s", source, targets[t]);
+        snprintf(readLine, sizeof(readLine), "cat < %s > /dev/null", targets[t]);
+        double start = nowSeconds();
+        for (int r = 0; r < repeats; r++) {
+            executeLine(writeLine);
+            executeLine(readLine);
+        }
+        printf(", \"%s_mb_per_s\": %.1f", names[t], repeats * size / (nowSeconds() - start) / 1e6);
+    }
+    printf("}");
+    char* drop[] = {"drop", "@scratch", NULL};
+    dropBuiltin(2, drop);
+    unlink(scratch);
+    unlink(source);
+}
+
+// RSS before and after running many command lines through executeLine. Most lines are
+// builtins so a million of them finish quickly; every 10000th line launches a process.
+void benchRss() {
+    long total = quickMode ? 100000 : 1000000;
+    const char* lines[] = {
+        "set pipefail off",
+        "cd . && hash -r",
+        "set launch spawn ; set pipesize 0 || cd /",
+        "jobs ; set 'pipefail' \"off\" && cd ~",
+    };
+    char buffer[256];
+
+    // Warm up so one-time allocations are not counted as growth
+    for (int i = 0; i < 1000; i++) {
+        strcpy(buffer, lines[i % 4]);
+        executeLine(buffer);
+    }
+    long before = residentKilobytes();
+    double start = nowSeconds();
+    for (long i = 0; i < total; i++) {
+        strcpy(buffer, (i % 10000 == 9999) ? "/bin/true > /dev/null" : lines[i % 4]);
+        executeLine(buffer);
+    }
+    double elapsed = nowSeconds() - start;
+    long after = residentKilobytes();
+
+    beginResult("rss");
+    printf("{\"commands\": %ld, \"rss_before_kb\": %ld, \"rss_after_kb\": %ld, \"growth_kb\": %ld, "
+           "\"commands_per_s\": %.0f}", total, before, after, after - before, total / elapsed);
+}
+
+// Sends one line to a --serve daemon and waits for its exit frame
+int serveRequest(int sock, const char* line, char** buf, size_t* cap) {
+    uint32_t len;
+    sendFrame(sock, FRAME_LINE, line, strlen(line));
+    int type;
+    while ((type = readFrame(sock, buf, cap, &len)) != FRAME_EXIT) {
+        if (type < 0) return -1;
+    }
+    return 0;
+}
+
+// Request latency and throughput of a --serve daemon over one connection
+void benchServe() {
+    int iterations = quickMode ? 2000 : 20000;
+    char path[64];
+    snprintf(path, sizeof(path), "%s/serve.sock", benchDir);
+    fflush(stdout);
+    pid_t server = fork();
+    if (server == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        exit(serveCommands(path, 2));
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    for (int tries = 0; connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 && tries < 500; tries++) {
+        usleep(10000); // Wait for the daemon to listen
+    }
+
+    const char* lines[] = {"true", "/bin/true"};
+    double* samples = malloc(iterations * sizeof(double));
+    char* buf = NULL;
+    size_t cap = 0;
+    beginResult("serve");
+    printf("{\"workers\": 2");
+    for (int l = 0; l < 2; l++) {
+        int count = (l == 0) ? iterations : iterations / 10; // Launching processes is slower
+        int completed = 0;
+        double start = nowSeconds();
+        while (completed < count) {
+            double t = nowSeconds();
+            if (serveRequest(sock, lines[l], &buf, &cap) < 0) break;
+            samples[completed++] = (nowSeconds() - t) * 1e6;
+        }
+        double elapsed = nowSeconds() - start;
+        if (completed < count) {
+            // Timings of a broken connection mean nothing; report the failure instead
+            printf(", \"%s\": {\"error\": \"request %d of %d failed\"}", lines[l], completed + 1, count);
+            continue;
+        }
+        qsort(samples, completed, sizeof(double), compareDoubles);
+        printf(", \"%s\": {\"requests_per_s\": %.0f, \"p50_us\": %.1f, \"p99_us\": %.1f}",
+               lines[l], completed / elapsed, percentile(samples, completed, 50), percentile(samples, completed, 99));
+    }
+    printf("}");
+    close(sock);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    free(samples);
+    memFree(buf);
+}
+
+// Soak test behind 'make soak': runs a mix of command lines through executeLine and fails
+// unless resident memory and the shell's live heap stay flat after a warm-up. The mix
+// keeps every cache busy: distinct lines evict plans, globs rescan a changing directory,
+// pipelines and background jobs fork, and some lines are syntax errors.
+int benchSoak(long total) {
+    char dir[96], path[128], line[256];
+    snprintf(dir, sizeof(dir), "%s/soak", benchDir);
+    mkdir(dir, 0755);
+    for (int i = 0; i < 16; i++) {
+        snprintf(path, sizeof(path), "%s/f%02d.c", dir, i);
+        close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    }
+    setenv("SHELL24_HISTFILE", "", 1);
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+
+    const char* fixed[] = {
+        "true && echo soak > /dev/null",
+        "false || printf '%%d %%s\\n' 42 x > /dev/null",
+        "set pipefail off ; cd . ; hash",
+        "[ -d / ] && test 1 -lt 2 || echo no",
+        "echo 'a b' \"c\" > /dev/null ; jobs",
+        "true | && false",
+    };
+    int checkpoints = 10;
+    long rss[11], live[11];
+    long warmup = total / checkpoints;
+    double start = nowSeconds();
+    for (long i = 0; i < total + warmup; i++) {
+        if (i % 10000 == 9999) {
+            snprintf(line, sizeof(line), "/bin/true %ld &", i);
+        } else if (i % 1000 == 999) {
+            snprintf(line, sizeof(line), "echo %ld | cat > /dev/null", i);
+        } else if (i % 100 == 50) {
+            snprintf(path, sizeof(path), "%s/f%02ld.c", dir, (i / 100) % 16);
+            utimensat(AT_FDCWD, path, NULL, 0); // Next glob has to list the directory again
+            snprintf(line, sizeof(line), "true %s/*.c %s/f0?.[ch]", dir, dir);
+        } else if (i % 2) {
+            snprintf(line, sizeof(line), "true %ld && cd .", i); // Not seen before: evicts a plan
+        } else {
+            snprintf(line, sizeof(line), fixed[(i / 2) % 6]);
+        }
+        executeLine(line);
+        if (i % 1000 == 0) notifyFinishedJobs(0);
+
+        long done = i + 1 - warmup;
+        if (done >= 0 && done % (total / checkpoints) == 0 && done / (total / checkpoints) <= checkpoints) {
+            int c = done / (total / checkpoints);
+            size_t bytes = 0;
+            for (int o = 0; o < MEM_OWNERS; o++) bytes += memUsage[o].liveBytes;
+            rss[c] = residentKilobytes();
+            live[c] = bytes;
+        }
+    }
+    double elapsed = nowSeconds() - start;
+    while (jobList) waitForJob(jobList, 0);
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+
+    // Caches are full after the warm-up, so whatever grows from here on is a leak
+    int flat = rss[checkpoints] - rss[0] <= 1024 && live[checkpoints] - live[0] <= 64 * 1024;
+    beginResult("soak");
+    printf("{\"lines\": %ld, \"lines_per_s\": %.0f, \"rss_kb\": [", total, (total + warmup) / elapsed);
+    for (int c = 0; c <= checkpoints; c++) printf("%s%ld", c ? ", " : "", rss[c]);
+    printf("], \"live_bytes\": [");
+    for (int c = 0; c <= checkpoints; c++) printf("%s%ld", c ? ", " : "", live[c]);
+    printf("], \"flat\": %s}\n}\n", flat ? "true" : "false");
+
+    for (int i = 0; i < 16; i++) {
+        snprintf(path, sizeof(path), "%s/f%02d.c", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+    rmdir(benchDir);
+    return flat ? 0 : 1;
+}
+
+typedef struct {
+    const char* name;
+    void (*run)();
+} Benchmark;
+
+Benchmark benchmarks[] = {
+    {"launch", benchLaunch},
+    {"parse", benchParse},
+    {"pipeline", benchPipeline},
+    {"concat", benchConcat},
+    {"ring", benchRing},
+    {"fanout", benchFanOut},
+    {"rss", benchRss},
+    {"glob", benchGlob},
+    {"history", benchHistory},
+    {"newt", benchNewt},
+    {"subst", benchSubst},
+    {"redir", benchRedir},
+    {"buffers", benchBuffers},
+    {"serve", benchServe},
+};
+
+int main(int argc, char** argv) {
+    int selected = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) quickMode = 1;
+        else selected++;
+    }
+    if (mkdtemp(benchDir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    initJobControl(0);
+    if (argc > 1 && strcmp(argv[1], "--soak") == 0) {
+        return benchSoak(argc > 2 ? atol(argv[2]) : 5000000);
+    }
+
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        int run = (selected == 0);
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], benchmarks[b].name) == 0) run = 1;
+        }
+        if (run) benchmarks[b].run();
+    }
+    printf("%s\n}\n", firstResult ? "{" : "");
+    rmdir(benchDir);
+    return 0;
+}
@@ -0,0 +1,102 @@
+// Example client for 'shell24 --serve SOCKET'.
+//
+// Usage: shell24_client SOCKET [LINE...]
+// Sends each LINE (or each line of stdin) over one connection, copies the replies to
+// stdout/stderr and exits with the status of the last line.
+//
+// Protocol: every frame is a type byte, a 4-byte big-endian length and the payload.
+//   client -> server  'L' command line
+//   server -> client  'O' stdout data, 'E' stderr data (any number of each), then
+//                     'X' with the 4-byte big-endian exit status of the line
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+int writeAll(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int readFull(int fd, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sends one line and copies its output; returns its exit status, -1 if the server went away
+int runLine(int sock, const char* line) {
+    char header[5];
+    uint32_t len = htonl(strlen(line));
+    header[0] = 'L';
+    memcpy(header + 1, &len, 4);
+    if (writeAll(sock, header, 5) < 0 || writeAll(sock, line, strlen(line)) < 0) return -1;
+
+    char buf[65536];
+    while (readFull(sock, header, 5) == 0) {
+        memcpy(&len, header + 1, 4);
+        len = ntohl(len);
+        while (len > 0) {
+            size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+            if (readFull(sock, buf, chunk) < 0) return -1;
+            if (header[0] == 'O') writeAll(STDOUT_FILENO, buf, chunk);
+            if (header[0] == 'E') writeAll(STDERR_FILENO, buf, chunk);
+            if (header[0] == 'X') {
+                uint32_t status;
+                memcpy(&status, buf, 4);
+                return ntohl(status);
+            }
+            len -= chunk;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s SOCKET [LINE...]\n", argv[0]);
+        return 2;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    int status = 0;
+    if (argc > 2) {
+        for (int i = 2; i < argc && status >= 0; i++) status = runLine(sock, argv[i]);
+    } else {
+        char* line = NULL;
+        size_t cap = 0;
+        ssize_t n;
+        while (status >= 0 && (n = getline(&line, &cap, stdin)) > 0) {
+            if (line[n - 1] == '\n') line[n - 1] = '\0';
+            status = runLine(sock, line);
+        }
+        free(line);
+    }
+    close(sock);
+    if (status < 0) {
+        fprintf(stderr, "%s: connection closed by server\n", argv[0]);
+        return 1;
+    }
+    return status;
+}
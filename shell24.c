@@ -1,639 +1,6214 @@
+#define _GNU_SOURCE // copy_file_range, splice, readahead
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <poll.h>
+#include <spawn.h>
+#include <time.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <pty.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
 
-#define MAX_PIPES 6
 #define MAX_ARGS 5 
 #define OUTPUT_APPEND 2 
 #define OUTPUT_TRUNC 1 
+#define LAUNCH_SPAWN 0 // posix_spawn (vfork-style clone on Linux), no page-table copy
+#define LAUNCH_FORK 1  // classic fork() + execvp()
+#define PATH_CACHE_BUCKETS 256
+#define CONCAT_CHUNK (1 << 30)         // Bytes moved per zero-copy call when concatenating
+#define CONCAT_BUFFER_SIZE (1 << 20)   // Buffer for the last-resort read/write copy
+#define CONCAT_READAHEAD (8 << 20)     // How much of each input to prefetch
+#define LINE_BUFFER_SIZE 65536         // Initial size of the reused input line buffer
+#define ARENA_BLOCK_SIZE 65536         // Initial size of the per-line arena
+#define PATH_CACHE_RECHECK_SECS 1 // How often the mtimes of the $PATH directories are re-checked
+#define REDIR_CACHE_SIZE 32            // '>>' and '<' targets the shell keeps open
+#define REDIR_RECHECK_SECS 1           // How often a cached target's path is stat'ed again
+#define FRAME_HEADER_SIZE 5            // Type byte + big-endian payload length
+#define FRAME_MAX_PAYLOAD (1 << 24)
+#define FRAME_LINE 'L'                 // Client -> server: one command line
+#define FRAME_STDOUT 'O'               // Server -> client: output of the running line
+#define FRAME_STDERR 'E'
+#define FRAME_EXIT 'X'                 // Server -> client: 4-byte exit status, ends the reply
+#define MEMO_DEFAULT_LIMIT (256L << 20) // Default 'set memosize'
+#define RING_DEFAULT_SIZE 0 // Default 'set ringsize': off, splice() between pipes is faster for file data
+#define KILL_GRACE_DEFAULT_MS 2000   // Default 'set killgrace'
+#define TIMEOUT_EXIT_STATUS 124      // Exit status of a job stopped by its deadline, as timeout(1)
+#define BUILTIN_EXTERNAL -1           // Returned by a builtin to have the real program run instead
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_CPU_PERIOD_US 100000    // cpu.max period used for 'run --cpu-max'
+#define IOPRIO_CLASS_SHIFT 13          // ioprio_set() encoding, from linux/ioprio.h
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define HISTOGRAM_SUB_BITS 4           // Each power of two is split into 2^4 linear steps
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 33) // Microseconds up to ~19 hours
+#define MAX_POLLED_SESSIONS 64 // 'newt' sessions watched while waiting for input
 
-pid_t last_background_pid = -1; // Initialize to -1 indicating no background process yet
-
-int validateArgsAndSpecialChars(char** arguments, int numOfArgs);
-
-// Function to replace the first occurrence of '~' with the user's home directory
-char* replace_tilde_with_home(char* command) {
-    // Find the first occurrence of '~' in the command
-    char* tilde = strchr(command, '~');
-    if (tilde) {
-        char* home = getenv("HOME"); // Get the path to the home directory
-        if (home) {
-            // Allocate enough space for the new command string
-            char* newCommand = malloc(strlen(command) + strlen(home) - 1); // -1 because we replace 1 character ('~')
-            if (newCommand) {
-                // Copy the part of the command before '~'
-                strncpy(newCommand, command, tilde - command);
-                // Append the home directory path
-                strcpy(newCommand + (tilde - command), home);
-                // Append the rest of the command after '~'
-                strcat(newCommand, tilde + 1);
-                // Replace the original command with the new one
-                //free(command);
-                return newCommand;
+extern char **environ;
+
+int launchMode = LAUNCH_SPAWN;  // How external commands are started, see 'set launch'
+int pipefailEnabled = 0;        // 'set pipefail on': a pipeline fails if any stage fails
+int pipeCapacity = 0;           // 'set pipesize': F_SETPIPE_SZ for pipeline pipes, 0 = kernel default
+long ringSize = RING_DEFAULT_SIZE; // 'set ringsize': ring between in-shell stages, 0 = always pipes
+long memoLimit = MEMO_DEFAULT_LIMIT; // 'set memosize': bytes the 'memo' cache may use
+long commandDeadlineMs = 0;     // 'set deadline': longest a foreground job may run, 0 = no limit
+long killGraceMs = KILL_GRACE_DEFAULT_MS; // 'set killgrace': SIGTERM to SIGKILL after a deadline
+int redirCacheEnabled = 1;      // 'set redircache off': open '>>' and '<' targets every time
+long bufferCap = 0;             // 'set buffercap': bytes all '@name' buffers may hold, 0 = no limit
+FILE* traceFile = NULL;         // SHELL24_TRACE: one JSON line per finished command
+uint64_t lineParseUs = 0;       // Time spent parsing the line that is being executed
+const char* currentLine = NULL; // Source text of the line that is being executed
+
+int execute_newt_command();
+int foregroundBuiltin(int argc, char** argv);
+int backgroundBuiltin(int argc, char** argv);
+int jobsBuiltin(int argc, char** argv);
+int waitBuiltin(int argc, char** argv);
+int parallelBuiltin(int argc, char** argv);
+int newtBuiltin(int argc, char** argv);
+int sessionsBuiltin(int argc, char** argv);
+int attachBuiltin(int argc, char** argv);
+void concatenateFiles(char **files, int numFiles);
+int copyToStdout(int fd, mode_t outType);
+int writeAll(int fd, const char* buf, size_t len);
+void evictMemoFiles();
+int sessionPollFds(struct pollfd* fds, int max);
+void serviceSessions(struct pollfd* fds, int count);
+void recordSessionExit(pid_t pid, int status);
+
+// Owners of the shell's heap memory, as listed by 'memstat'. Every block the shell keeps
+// comes from memAlloc() and friends and is charged to one of these.
+enum {
+    MEM_LINE,       // lineArena: tokens and commands of the line being run
+    MEM_PLANS,      // Plan cache
+    MEM_INPUT,      // Line reader buffers
+    MEM_PATH,       // $PATH lookup cache
+    MEM_GLOB,       // Directory listings and glob results
+    MEM_JOBS,       // Job table
+    MEM_STATS,      // Per-command statistics
+    MEM_MEMO,       // 'memo' keys and file lists
+    MEM_HISTORY,    // History index (the history file itself is mapped)
+    MEM_IO,         // Copy buffers of '#' and '>|'
+    MEM_PARALLEL,   // 'parallel' tasks and their output
+    MEM_SESSIONS,   // 'newt' sessions and their backlogs
+    MEM_SERVER,     // --serve connections
+    MEM_REDIR,      // Paths of cached redirection targets
+    MEM_BUFFERS,    // '@name' buffer table (the data itself is in memfds)
+    MEM_OWNERS
+};
+
+const char* memOwnerNames[MEM_OWNERS] = {
+    "line", "plans", "input", "path-cache", "glob", "jobs", "stats",
+    "memo", "history", "io", "parallel", "sessions", "server", "redir-cache", "buffers",
+};
+
+typedef struct {
+    size_t liveBytes, peakBytes;
+    uint64_t liveBlocks, allocations, frees;
+} MemUsage;
+
+MemUsage memUsage[MEM_OWNERS];
+
+// Put in front of every block so memFree() knows its owner and size; 16 bytes keeps the
+// blocks as aligned as malloc() returns them
+typedef struct {
+    uint32_t owner;
+    uint32_t unused;
+    size_t size;
+} MemHeader;
+
+void* chargeBlock(int owner, MemHeader* header, size_t size) {
+    if (header == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    header->owner = owner;
+    header->size = size;
+    MemUsage* usage = &memUsage[owner];
+    usage->liveBytes += size;
+    usage->liveBlocks++;
+    usage->allocations++;
+    if (usage->liveBytes > usage->peakBytes) usage->peakBytes = usage->liveBytes;
+    return header + 1;
+}
+
+void* memAlloc(int owner, size_t size) {
+    return chargeBlock(owner, malloc(sizeof(MemHeader) + size), size);
+}
+
+void* memCalloc(int owner, size_t count, size_t size) {
+    return chargeBlock(owner, calloc(1, sizeof(MemHeader) + count * size), count * size);
+}
+
+void memFree(void* ptr) {
+    if (ptr == NULL) return;
+    MemHeader* header = (MemHeader*)ptr - 1;
+    MemUsage* usage = &memUsage[header->owner];
+    usage->liveBytes -= header->size;
+    usage->liveBlocks--;
+    usage->frees++;
+    free(header);
+}
+
+// Like realloc(); a block keeps the owner it was allocated for
+void* memRealloc(int owner, void* ptr, size_t size) {
+    if (ptr == NULL) return memAlloc(owner, size);
+    MemHeader* header = (MemHeader*)ptr - 1;
+    owner = header->owner;
+    MemUsage* usage = &memUsage[owner];
+    usage->liveBytes -= header->size;
+    usage->liveBlocks--;
+    return chargeBlock(owner, realloc(header, sizeof(MemHeader) + size), size);
+}
+
+char* memStrndup(int owner, const char* str, size_t len) {
+    char* copy = memAlloc(owner, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char* memStrdup(int owner, const char* str) {
+    return memStrndup(owner, str, strlen(str));
+}
+
+// Block of arena memory; blocks are chained when a line needs more than the first one
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size, used;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator for everything that lives only as long as one command line
+typedef struct {
+    ArenaBlock* head;
+    size_t blockSize;   // Size of the next block; grows to fit the largest line seen
+    int owner;          // Charged for the blocks, see memstat
+} Arena;
+
+Arena lineArena = {NULL, ARENA_BLOCK_SIZE, MEM_LINE};
+
+void* arenaAlloc(Arena* arena, size_t size) {
+    size = (size + 15) & ~(size_t)15; // Keep every allocation 16-byte aligned
+    ArenaBlock* block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        size_t blockSize = arena->blockSize;
+        while (blockSize < size) blockSize *= 2;
+        block = memAlloc(arena->owner, sizeof(ArenaBlock) + blockSize);
+        if (block == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        block->size = blockSize;
+        block->used = 0;
+        block->next = arena->head;
+        arena->head = block;
+    }
+    void* ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char* arenaStrndup(Arena* arena, const char* str, size_t len) {
+    char* copy = arenaAlloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Releases everything allocated since the last reset. Only one block is kept, sized for
+// the biggest line so far, so memory stays flat no matter how many lines are run.
+void arenaReset(Arena* arena) {
+    if (arena->head == NULL) return;
+    if (arena->head->next != NULL) {
+        size_t total = 0;
+        while (arena->head) {
+            ArenaBlock* next = arena->head->next;
+            total += arena->head->size;
+            memFree(arena->head);
+            arena->head = next;
+        }
+        arena->blockSize = total;
+        return; // The next allocation creates one block big enough for all of it
+    }
+    arena->head->used = 0;
+}
+
+void arenaFree(Arena* arena) {
+    while (arena->head) {
+        ArenaBlock* next = arena->head->next;
+        memFree(arena->head);
+        arena->head = next;
+    }
+}
+
+typedef enum {
+    TOK_WORD,
+    TOK_AND,      // &&
+    TOK_OR,       // ||
+    TOK_PIPE,     // |
+    TOK_SEMI,     // ;
+    TOK_BG,       // &
+    TOK_CONCAT,   // #
+    TOK_IN,       // <
+    TOK_OUT,      // >
+    TOK_APPEND,   // >>
+    TOK_TEE,      // >| (one more copy of stdout)
+    TOK_END
+} TokenType;
+
+// A word with '$(...)' in it, in order: text[0] lines[0] text[1] ... lines[count-1] text[count]
+typedef struct {
+    int count, capacity;
+    char** text;            // Literal runs around the substitutions (quotes and escapes removed)
+    char** lines;           // Command line of each substitution
+    unsigned char* quoted;  // Inside "...": the output stays one word instead of being split
+} SubstWord;
+
+typedef struct {
+    TokenType type;
+    char* text;   // Word text (quotes and escapes removed) or the operator itself
+    char* glob;   // Glob pattern of a word with unquoted wildcards, NULL otherwise
+    SubstWord* subst; // Word with '$(...)' (text is then its first literal run), NULL otherwise
+} Token;
+
+// Placement and limits set by a 'run' prefix, shared by the stages of its pipeline
+typedef struct {
+    cpu_set_t cpus;
+    int hasCpus;
+    int pin;            // Each stage on a CPU of its own
+    int nice, hasNice;
+    int policy;         // SCHED_OTHER/BATCH/IDLE, -1 to keep the shell's
+    int ioClass, ioLevel; // ioprio class (0 to keep the shell's) and level
+    long long memoryMax;  // cgroup memory.max in bytes, 0 for none
+    long cpuQuotaUs;      // cgroup cpu.max quota per CGROUP_CPU_PERIOD_US, 0 for none
+    char* cgroup;         // Leaf cgroup created for the pipeline, owned by its job
+} ProcessLimits;
+
+// One command of a parsed line
+typedef struct {
+    char** argv;
+    int argc;
+    char** globs;       // Per argument: glob pattern or NULL; NULL when there are none
+    SubstWord** substs; // Per argument: '$(...)' template or NULL; NULL when there are none
+    char* fileIP;       // '<' target
+    char* fileOP;       // '>' or '>>' target
+    int outputMode;
+    int isConcat;       // argv lists files joined by '#'
+    char** teeFiles;    // '>|' targets that get a copy of stdout
+    int teeCount;
+    int timed;          // Preceded by 'time' (only the first command of a pipeline)
+    long timeoutMs;     // 'timeout' prefix of the pipeline (first command), 0 for none
+    long killAfterMs;   // 'timeout -k': SIGTERM to SIGKILL, -1 for 'set killgrace'
+    ProcessLimits* limits; // 'run' prefix of the pipeline (first command; copied to each stage)
+    int stageIndex;     // Position in its pipeline, set when the stage is launched
+    struct RingBuffer* inRing;  // Set when launched: input comes from a ring instead of a pipe
+    struct RingBuffer* outRing; // Set when launched: output goes to a ring instead of a pipe
+    TokenType next;     // Operator after this command, TOK_END for the last one
+} Command;
+
+// Byte classes for the lexer: anything non-zero ends the plain part of a word
+#define LEX_SPACE 1
+#define LEX_OPERATOR 2
+#define LEX_QUOTE 3
+#define LEX_WILDCARD 4  // Kept in the word, but makes it a glob pattern
+#define LEX_SUBST 5     // '$': starts a substitution when '(' follows
+
+const unsigned char lexClass[256] = {
+    [' '] = LEX_SPACE, ['\t'] = LEX_SPACE, ['\n'] = LEX_SPACE, ['\r'] = LEX_SPACE,
+    ['&'] = LEX_OPERATOR, ['|'] = LEX_OPERATOR, [';'] = LEX_OPERATOR, ['#'] = LEX_OPERATOR,
+    ['<'] = LEX_OPERATOR, ['>'] = LEX_OPERATOR,
+    ['\\'] = LEX_QUOTE, ['\''] = LEX_QUOTE, ['"'] = LEX_QUOTE,
+    ['*'] = LEX_WILDCARD, ['?'] = LEX_WILDCARD, ['['] = LEX_WILDCARD,
+    ['$'] = LEX_SUBST,
+};
+
+// Word-at-a-time helpers: flag the bytes of v that are zero, equal to c, or below n
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+#define SWAR_LESS(v, n) (((v) - SWAR_ONES * (n)) & ~(v) & SWAR_HIGHS)
+#define SWAR_EQ(v, c) SWAR_LESS((v) ^ (SWAR_ONES * (unsigned char)(c)), 1)
+
+// Returns the first byte in [p, end) that the lexer has to look at, or end.
+// Eight bytes are tested per step; every special byte is below '(' or one of *;<>?[\|
+// (only '!', '%' and control bytes are false positives and get re-checked).
+const char* findSpecialByte(const char* p, const char* end) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (end - p >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        uint64_t mask = SWAR_LESS(v, '(') | SWAR_EQ(v, ';') | SWAR_EQ(v, '<') | SWAR_EQ(v, '>') |
+                        SWAR_EQ(v, '\\') | SWAR_EQ(v, '|') | SWAR_EQ(v, '*') | SWAR_EQ(v, '?') | SWAR_EQ(v, '[');
+        if (mask == 0) {
+            p += 8;
+            continue;
+        }
+        // The lowest flagged byte is always exact; borrows can only add flags above it
+        p += __builtin_ctzll(mask) >> 3;
+        if (lexClass[(unsigned char)*p]) return p;
+        p++;
+    }
+#endif
+    while (p < end && !lexClass[(unsigned char)*p]) p++;
+    return p;
+}
+
+// home followed by rest, in the arena
+char* prefixHome(Arena* arena, const char* home, const char* rest) {
+    size_t homeLen = strlen(home), restLen = strlen(rest);
+    char* expanded = arenaAlloc(arena, homeLen + restLen + 1);
+    memcpy(expanded, home, homeLen);
+    memcpy(expanded + homeLen, rest, restLen + 1);
+    return expanded;
+}
+
+int hasGlobSyntax(const char* text);
+
+// Builds the glob pattern of a word that has quoted parts, from its source text: quoted
+// bytes are escaped with '\' so only the unquoted wildcards act. NULL if there are none.
+char* quotedGlobPattern(Arena* arena, const char* p, const char* end) {
+    char* pattern = arenaAlloc(arena, 2 * (end - p) + 1);
+    char* out = pattern;
+    int wildcards = 0;
+    char quote = 0;
+    for (; p < end; p++) {
+        int literal = 1;
+        if (quote == '\'') {
+            if (*p == quote) { quote = 0; continue; }
+        } else if (quote == '"') {
+            if (*p == quote) { quote = 0; continue; }
+            if (*p == '\\' && p + 1 < end && (p[1] == '"' || p[1] == '\\' || p[1] == '$')) p++;
+        } else if (*p == '\'' || *p == '"') {
+            quote = *p;
+            continue;
+        } else if (*p == '\\') {
+            if (p + 1 < end) p++;
+        } else {
+            literal = 0;
+            if (*p == '*' || *p == '?' || *p == '[') wildcards = 1;
+        }
+        if (literal && strchr("*?[]\\", *p)) *out++ = '\\';
+        *out++ = *p;
+    }
+    *out = '\0';
+    return wildcards && hasGlobSyntax(pattern) ? pattern : NULL;
+}
+
+// Finds the ')' that closes a '$(' whose command line starts at p, skipping quoted text
+// and nested parentheses; NULL when the line ends first
+const char* findSubstitutionEnd(const char* p, const char* end) {
+    int depth = 0;
+    for (; p < end; p++) {
+        if (*p == '\\') {
+            if (p + 1 < end) p++;
+        } else if (*p == '\'') {
+            p = memchr(p + 1, '\'', end - p - 1);
+            if (p == NULL) return NULL;
+        } else if (*p == '"') {
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\' && p + 1 < end) p++;
+            }
+            if (p >= end) return NULL;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && depth-- == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Lexes the '$(...)' at p into the word being built: the text since *run becomes one
+// literal run and the command line is kept for when the command runs. Returns the byte
+// after ')', or NULL after reporting an unterminated substitution.
+const char* lexSubstitution(Arena* arena, const char* p, const char* end, char** text, char** run,
+                            SubstWord** word, int quoted) {
+    const char* close = findSubstitutionEnd(p + 2, end);
+    if (close == NULL) {
+        printf("shell24: unterminated $(\n");
+        return NULL;
+    }
+    SubstWord* w = *word;
+    if (w == NULL) {
+        w = *word = arenaAlloc(arena, sizeof(SubstWord));
+        memset(w, 0, sizeof(*w));
+    }
+    if (w->count + 2 > w->capacity) {
+        int capacity = w->capacity ? w->capacity * 2 : 4;
+        char** runs = arenaAlloc(arena, capacity * sizeof(char*));
+        char** lines = arenaAlloc(arena, capacity * sizeof(char*));
+        unsigned char* flags = arenaAlloc(arena, capacity);
+        if (w->count > 0) {
+            memcpy(runs, w->text, w->count * sizeof(char*));
+            memcpy(lines, w->lines, w->count * sizeof(char*));
+            memcpy(flags, w->quoted, w->count);
+        }
+        w->text = runs;
+        w->lines = lines;
+        w->quoted = flags;
+        w->capacity = capacity;
+    }
+    // The NUL fits: the three bytes of '$()' are never copied into the word text
+    *(*text)++ = '\0';
+    w->text[w->count] = *run;
+    w->lines[w->count] = arenaStrndup(arena, p + 2, close - p - 2);
+    w->quoted[w->count] = quoted;
+    w->count++;
+    *run = *text;
+    return close + 1;
+}
+
+// Splits a line into words and operators in one pass. Tokens and their text are
+// allocated from the arena; returns the number of tokens or -1 on a syntax error.
+int lexCommandLine(Arena* arena, const char* line, size_t len, Token** out) {
+    const char* p = line;
+    const char* end = line + len;
+    int capacity = 16, count = 0;
+    Token* tokens = arenaAlloc(arena, capacity * sizeof(Token));
+    // Word text never needs more bytes than the line itself: every word's terminator
+    // takes the place of the separator (or end of line) that ended it
+    char* text = arenaAlloc(arena, len + 1);
+
+    while (1) {
+        while (p < end && lexClass[(unsigned char)*p] == LEX_SPACE) p++;
+        if (p >= end) break;
+
+        if (count + 1 >= capacity) {
+            Token* grown = arenaAlloc(arena, capacity * 2 * sizeof(Token));
+            memcpy(grown, tokens, count * sizeof(Token));
+            tokens = grown;
+            capacity *= 2;
+        }
+        Token* tok = &tokens[count++];
+        tok->glob = NULL;
+        tok->subst = NULL;
+
+        if (lexClass[(unsigned char)*p] == LEX_OPERATOR) {
+            int doubled = p + 1 < end && p[1] == p[0];
+            switch (*p) {
+                case '&': tok->type = doubled ? TOK_AND : TOK_BG; tok->text = doubled ? "&&" : "&"; break;
+                case '|': tok->type = doubled ? TOK_OR : TOK_PIPE; tok->text = doubled ? "||" : "|"; break;
+                case '>':
+                    if (p + 1 < end && p[1] == '|') {
+                        tok->type = TOK_TEE;
+                        tok->text = ">|";
+                        doubled = 1;
+                    } else {
+                        tok->type = doubled ? TOK_APPEND : TOK_OUT;
+                        tok->text = doubled ? ">>" : ">";
+                    }
+                    break;
+                case ';': tok->type = TOK_SEMI; tok->text = ";"; doubled = 0; break;
+                case '#': tok->type = TOK_CONCAT; tok->text = "#"; doubled = 0; break;
+                default:  tok->type = TOK_IN; tok->text = "<"; doubled = 0; break;
+            }
+            p += doubled ? 2 : 1;
+            continue;
+        }
+
+        // A word: copy plain runs in bulk, handle quotes and escapes as they come
+        tok->type = TOK_WORD;
+        tok->text = text;
+        const char* wordStart = p;
+        int tilde = (*p == '~');
+        int quoted = 0, wildcards = 0;
+        SubstWord* subst = NULL;
+        char* run = text; // Start of the current literal run of a word with substitutions
+        while (p < end) {
+            const char* special = findSpecialByte(p, end);
+            memcpy(text, p, special - p);
+            text += special - p;
+            p = special;
+            if (p < end && lexClass[(unsigned char)*p] == LEX_WILDCARD) {
+                wildcards = 1;
+                *text++ = *p++;
+                continue;
+            }
+            if (p < end && lexClass[(unsigned char)*p] == LEX_SUBST) {
+                if (p + 1 < end && p[1] == '(') {
+                    p = lexSubstitution(arena, p, end, &text, &run, &subst, 0);
+                    if (p == NULL) return -1;
+                } else {
+                    *text++ = *p++;
+                }
+                continue;
+            }
+            if (p >= end || lexClass[(unsigned char)*p] != LEX_QUOTE) break;
+
+            quoted = 1;
+            if (*p == '\\') {
+                // Backslash makes the next byte literal
+                if (p + 1 < end) p++;
+                *text++ = *p++;
+            } else if (*p == '\'') {
+                const char* close = memchr(p + 1, '\'', end - p - 1);
+                if (close == NULL) {
+                    printf("shell24: unterminated quote\n");
+                    return -1;
+                }
+                memcpy(text, p + 1, close - p - 1);
+                text += close - p - 1;
+                p = close + 1;
+            } else {
+                p++;
+                while (p < end && *p != '"') {
+                    if (*p == '$' && p + 1 < end && p[1] == '(') {
+                        p = lexSubstitution(arena, p, end, &text, &run, &subst, 1);
+                        if (p == NULL) return -1;
+                        continue;
+                    }
+                    if (*p == '\\' && p + 1 < end && (p[1] == '"' || p[1] == '\\' || p[1] == '$')) p++;
+                    *text++ = *p++;
+                }
+                if (p >= end) {
+                    printf("shell24: unterminated quote\n");
+                    return -1;
+                }
+                p++;
+            }
+        }
+        *text++ = '\0';
+        if (subst) {
+            subst->text[subst->count] = run;
+            tok->subst = subst;
+            wildcards = 0; // Words with substitutions are not globbed
+        }
+
+        // Wildcards only count where they were not quoted
+        if (wildcards && !quoted) {
+            if (hasGlobSyntax(tok->text)) tok->glob = tok->text;
+        } else if (wildcards) {
+            tok->glob = quotedGlobPattern(arena, wordStart, p);
+        }
+
+        // Leading '~' (unquoted) expands to the home directory
+        char* home = getenv("HOME");
+        if (tilde && home && (tok->text[1] == '\0' || tok->text[1] == '/')) {
+            int sameText = (tok->glob == tok->text);
+            tok->text = prefixHome(arena, home, tok->text + 1);
+            if (tok->glob) tok->glob = sameText ? tok->text : prefixHome(arena, home, tok->glob + 1);
+            if (subst) subst->text[0] = tok->text;
+        }
+    }
+
+    tokens[count].type = TOK_END;
+    tokens[count].text = NULL;
+    tokens[count].glob = NULL;
+    tokens[count].subst = NULL;
+    *out = tokens;
+    return count;
+}
+
+// Parses a size such as 512M or 2G; returns -1 if text is not one
+long long parseByteSize(const char* text) {
+    char* end;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0) return -1;
+    switch (*end) {
+        case 'K': case 'k': value <<= 10; end++; break;
+        case 'M': case 'm': value <<= 20; end++; break;
+        case 'G': case 'g': value <<= 30; end++; break;
+        case 'T': case 't': value <<= 40; end++; break;
+    }
+    return *end == '\0' ? value : -1;
+}
+
+// Parses a duration such as 30, 1.5s, 250ms, 2m or 1h into milliseconds; -1 if malformed
+long parseDuration(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return -1;
+    double scale = strcmp(end, "ms") == 0 ? 1 :
+                   strcmp(end, "") == 0 || strcmp(end, "s") == 0 ? 1000 :
+                   strcmp(end, "m") == 0 ? 60000 :
+                   strcmp(end, "h") == 0 ? 3600000 : -1;
+    return scale < 0 ? -1 : (long)(value * scale + 0.5);
+}
+
+// Reads '[-k DURATION] DURATION' after a 'timeout' word into the pipeline's first command.
+// Returns 0, or -1 after reporting a bad duration.
+int parseTimeoutOptions(Token* tokens, int tokenCount, int* i, Command* cmd) {
+    cmd->killAfterMs = -1;
+    if (*i + 1 < tokenCount && tokens[*i].type == TOK_WORD && strcmp(tokens[*i].text, "-k") == 0 &&
+        tokens[*i + 1].type == TOK_WORD) {
+        cmd->killAfterMs = parseDuration(tokens[*i + 1].text);
+        if (cmd->killAfterMs < 0) {
+            printf("timeout: bad duration '%s'\n", tokens[*i + 1].text);
+            return -1;
+        }
+        *i += 2;
+    }
+    if (*i >= tokenCount || tokens[*i].type != TOK_WORD) {
+        printf("timeout: missing duration\n");
+        return -1;
+    }
+    cmd->timeoutMs = parseDuration(tokens[*i].text);
+    if (cmd->timeoutMs <= 0) {
+        printf("timeout: bad duration '%s'\n", tokens[*i].text);
+        return -1;
+    }
+    (*i)++;
+    if (*i >= tokenCount || tokens[*i].type != TOK_WORD) {
+        printf("timeout: missing command\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Parses a CPU list such as 4-7 or 0,2,8-11
+int parseCpuList(const char* text, cpu_set_t* set) {
+    CPU_ZERO(set);
+    while (*text) {
+        char* end;
+        long first = strtol(text, &end, 10), last = first;
+        if (end == text) return -1;
+        if (*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text) return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        text = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// Reads the options of a 'run' prefix from tokens[*i] on, up to '--' or the first word
+// that is not an option. Returns 0, or -1 after reporting a bad option.
+int parseRunOptions(Arena* arena, Token* tokens, int tokenCount, int* i, ProcessLimits** out) {
+    ProcessLimits* limits = arenaAlloc(arena, sizeof(ProcessLimits));
+    memset(limits, 0, sizeof(*limits));
+    limits->policy = -1;
+
+    for (; *i < tokenCount && tokens[*i].type == TOK_WORD && strncmp(tokens[*i].text, "--", 2) == 0; (*i)++) {
+        const char* option = tokens[*i].text;
+        if (strcmp(option, "--") == 0) {
+            (*i)++;
+            break;
+        }
+        if (strcmp(option, "--pin") == 0) {
+            limits->pin = 1;
+            continue;
+        }
+        const char* value = (*i + 1 < tokenCount && tokens[*i + 1].type == TOK_WORD) ? tokens[*i + 1].text : NULL;
+        if (value == NULL) {
+            printf("run: %s needs a value\n", option);
+            return -1;
+        }
+        (*i)++;
+        char* end;
+        int ok = 1;
+        if (strcmp(option, "--cpus") == 0) {
+            ok = parseCpuList(value, &limits->cpus) == 0;
+            limits->hasCpus = 1;
+        } else if (strcmp(option, "--nice") == 0) {
+            limits->nice = strtol(value, &end, 10);
+            ok = (*end == '\0' && limits->nice >= -20 && limits->nice <= 19);
+            limits->hasNice = 1;
+        } else if (strcmp(option, "--sched") == 0) {
+            limits->policy = strcmp(value, "other") == 0 ? SCHED_OTHER :
+                             strcmp(value, "batch") == 0 ? SCHED_BATCH :
+                             strcmp(value, "idle") == 0 ? SCHED_IDLE : -1;
+            ok = (limits->policy >= 0);
+        } else if (strcmp(option, "--io") == 0) {
+            // idle, best-effort[:0-7] or realtime[:0-7]
+            size_t nameLen = strcspn(value, ":");
+            limits->ioClass = strncmp(value, "realtime", nameLen) == 0 && nameLen == 8 ? IOPRIO_CLASS_RT :
+                              strncmp(value, "best-effort", nameLen) == 0 && nameLen == 11 ? IOPRIO_CLASS_BE :
+                              strncmp(value, "idle", nameLen) == 0 && nameLen == 4 ? IOPRIO_CLASS_IDLE : 0;
+            limits->ioLevel = value[nameLen] ? strtol(value + nameLen + 1, &end, 10) : 4;
+            ok = limits->ioClass && limits->ioLevel >= 0 && limits->ioLevel <= 7 && (!value[nameLen] || *end == '\0');
+        } else if (strcmp(option, "--mem") == 0) {
+            limits->memoryMax = parseByteSize(value);
+            ok = (limits->memoryMax > 0);
+        } else if (strcmp(option, "--cpu-max") == 0) {
+            // CPUs' worth of time per period, e.g. 1.5
+            double cpus = strtod(value, &end);
+            limits->cpuQuotaUs = (long)(cpus * CGROUP_CPU_PERIOD_US);
+            ok = (*end == '\0' && limits->cpuQuotaUs >= 1000);
+        } else {
+            printf("run: unknown option '%s'\n", option);
+            return -1;
+        }
+        if (!ok) {
+            printf("run: bad value '%s' for %s\n", value, option);
+            return -1;
+        }
+    }
+    if (*i >= tokenCount || tokens[*i].type != TOK_WORD) {
+        printf("run: missing command\n");
+        return -1;
+    }
+    *out = limits;
+    return 0;
+}
+
+// Groups tokens into commands. Redirections are attached to their command, words joined
+// by '#' become one concatenation command, and 'next' records the operator that follows.
+// A 'time' word in front of a pipeline is a keyword and sets 'timed' on its first command;
+// so are 'timeout', which gives the pipeline a deadline, and 'run', whose options become
+// the pipeline's limits.
+// Returns the number of commands or -1 on a syntax error.
+int parseCommandLine(Arena* arena, Token* tokens, int tokenCount, Command** out) {
+    int maxCommands = 1;
+    for (int i = 0; i < tokenCount; i++) {
+        if (tokens[i].type == TOK_AND || tokens[i].type == TOK_OR || tokens[i].type == TOK_PIPE ||
+            tokens[i].type == TOK_SEMI || tokens[i].type == TOK_BG) {
+            maxCommands++;
+        }
+    }
+    Command* commands = arenaAlloc(arena, maxCommands * sizeof(Command));
+    int count = 0;
+    int i = 0;
+
+    while (i < tokenCount) {
+        Command* cmd = &commands[count++];
+        memset(cmd, 0, sizeof(*cmd));
+        cmd->outputMode = OUTPUT_TRUNC;
+        if ((count == 1 || cmd[-1].next != TOK_PIPE) && i + 1 < tokenCount &&
+            tokens[i].type == TOK_WORD && tokens[i + 1].type == TOK_WORD && strcmp(tokens[i].text, "time") == 0) {
+            cmd->timed = 1;
+            i++;
+        }
+        if ((count == 1 || cmd[-1].next != TOK_PIPE) && i + 1 < tokenCount &&
+            tokens[i].type == TOK_WORD && tokens[i + 1].type == TOK_WORD && strcmp(tokens[i].text, "timeout") == 0) {
+            i++;
+            if (parseTimeoutOptions(tokens, tokenCount, &i, cmd) < 0) return -1;
+        }
+        if ((count == 1 || cmd[-1].next != TOK_PIPE) && i + 1 < tokenCount &&
+            tokens[i].type == TOK_WORD && tokens[i + 1].type == TOK_WORD && strcmp(tokens[i].text, "run") == 0) {
+            i++;
+            if (parseRunOptions(arena, tokens, tokenCount, &i, &cmd->limits) < 0) return -1;
+        }
+
+        // Words up to the next control operator become argv
+        int words = 0, tees = 0, globs = 0, substs = 0;
+        int j = i;
+        for (; j < tokenCount; j++) {
+            TokenType type = tokens[j].type;
+            if (type == TOK_WORD) {
+                words++;
+                if (tokens[j].glob) globs++;
+                if (tokens[j].subst) substs++;
+            } else if (type == TOK_CONCAT) cmd->isConcat = 1;
+            else if (type == TOK_TEE) tees++;
+            else if (type != TOK_IN && type != TOK_OUT && type != TOK_APPEND) break;
+        }
+        cmd->argv = arenaAlloc(arena, (words + 1) * sizeof(char*));
+        if (tees > 0) cmd->teeFiles = arenaAlloc(arena, tees * sizeof(char*));
+        if (globs > 0) cmd->globs = arenaAlloc(arena, words * sizeof(char*));
+        if (substs > 0) cmd->substs = arenaAlloc(arena, words * sizeof(SubstWord*));
+
+        for (; i < j; i++) {
+            TokenType type = tokens[i].type;
+            if (type == TOK_WORD) {
+                if (cmd->globs) cmd->globs[cmd->argc] = tokens[i].glob;
+                if (cmd->substs) cmd->substs[cmd->argc] = tokens[i].subst;
+                cmd->argv[cmd->argc++] = tokens[i].text;
+            } else if (type == TOK_IN || type == TOK_OUT || type == TOK_APPEND || type == TOK_TEE) {
+                if (i + 1 >= j || tokens[i + 1].type != TOK_WORD) {
+                    printf("shell24: syntax error near '%s'\n", tokens[i].text);
+                    return -1;
+                }
+                i++;
+                if (tokens[i].subst) {
+                    printf("shell24: $(...) is only expanded in arguments, not in '%s' targets\n", tokens[i - 1].text);
+                    return -1;
+                }
+                if (type == TOK_IN) {
+                    cmd->fileIP = tokens[i].text;
+                } else if (type == TOK_TEE) {
+                    cmd->teeFiles[cmd->teeCount++] = tokens[i].text;
+                } else {
+                    cmd->fileOP = tokens[i].text;
+                    cmd->outputMode = (type == TOK_APPEND) ? OUTPUT_APPEND : OUTPUT_TRUNC;
+                }
+            }
+        }
+        cmd->argv[cmd->argc] = NULL;
+
+        cmd->next = (i < tokenCount) ? tokens[i].type : TOK_END;
+        if (i + 1 == tokenCount && (cmd->next == TOK_PIPE || cmd->next == TOK_AND || cmd->next == TOK_OR)) {
+            printf("shell24: syntax error near '%s'\n", tokens[i].text); // Nothing after the operator
+            return -1;
+        }
+        i++;
+    }
+
+    *out = commands;
+    return count;
+}
+
+// Glob expansion of '*', '?', '[...]' and '**' in arguments. Directory listings are read
+// with getdents64 and cached by device and inode; a listing is reused while the directory's
+// mtime is unchanged, so globbing a large directory again costs one stat() instead of a rescan.
+#define GLOB_CACHE_BUCKETS 256
+#define GLOB_CACHE_LIMIT (64 << 20)     // Bytes of cached names before the cache is dropped
+#define GLOB_SCAN_BUFFER (256 << 10)
+#define GLOB_RACY_NS 10000000           // A listing read this soon after a change is not reused
+#define GLOB_PATH_MAX 4096
+
+typedef struct DirListing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;      // Directory mtime before it was read
+    struct timespec scanned;    // When it was read (CLOCK_REALTIME)
+    char* names;                // NUL-terminated names, back to back
+    size_t namesLen, namesCap;
+    uint32_t* nameOffsets;
+    unsigned char* types;       // d_type of each entry; DT_UNKNOWN if the filesystem has none
+    uint32_t count, capacity;
+    struct DirListing* next;
+} DirListing;
+
+DirListing* dirCache[GLOB_CACHE_BUCKETS];
+DirListing* retiredListings;   // Replaced while an expansion may still be iterating them
+size_t dirCacheBytes = 0;
+struct {
+    unsigned long hits, scans;
+} globStats;
+
+void freeDirListings(DirListing** list) {
+    while (*list) {
+        DirListing* listing = *list;
+        *list = listing->next;
+        memFree(listing->names);
+        memFree(listing->nameOffsets);
+        memFree(listing->types);
+        memFree(listing);
+    }
+}
+
+void flushDirCache() {
+    for (int i = 0; i < GLOB_CACHE_BUCKETS; i++) {
+        freeDirListings(&dirCache[i]);
+    }
+    dirCacheBytes = 0;
+}
+
+void addDirEntry(DirListing* listing, const char* name, unsigned char type) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) return;
+    size_t len = strlen(name) + 1;
+    if (listing->namesLen + len > listing->namesCap) {
+        listing->namesCap = listing->namesCap ? listing->namesCap * 2 : 4096;
+        if (listing->namesCap < listing->namesLen + len) listing->namesCap = listing->namesLen + len;
+        listing->names = memRealloc(MEM_GLOB, listing->names, listing->namesCap);
+    }
+    if (listing->count == listing->capacity) {
+        listing->capacity = listing->capacity ? listing->capacity * 2 : 64;
+        listing->nameOffsets = memRealloc(MEM_GLOB, listing->nameOffsets, listing->capacity * sizeof(uint32_t));
+        listing->types = memRealloc(MEM_GLOB, listing->types, listing->capacity);
+    }
+    memcpy(listing->names + listing->namesLen, name, len);
+    listing->nameOffsets[listing->count] = listing->namesLen;
+    listing->types[listing->count++] = type;
+    listing->namesLen += len;
+}
+
+#ifdef __linux__
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+// Reads every entry of the open directory fd into the listing
+void readDirEntries(int fd, DirListing* listing) {
+#ifdef __linux__
+    static char* buffer;
+    if (!buffer) buffer = memAlloc(MEM_GLOB, GLOB_SCAN_BUFFER);
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buffer, GLOB_SCAN_BUFFER)) > 0) {
+        for (long offset = 0; offset < n;) {
+            struct LinuxDirent64* entry = (struct LinuxDirent64*)(buffer + offset);
+            addDirEntry(listing, entry->d_name, entry->d_type);
+            offset += entry->d_reclen;
+        }
+    }
+    close(fd);
+#else
+    DIR* dir = fdopendir(fd);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        addDirEntry(listing, entry->d_name, entry->d_type);
+    }
+    if (dir) closedir(dir);
+#endif
+}
+
+int timespecBefore(struct timespec a, struct timespec b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// Returns the entries of directory path, from the cache when it is still current
+DirListing* listDirectory(const char* path) {
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) return NULL;
+    unsigned int bucket = (unsigned int)(st.st_ino ^ st.st_dev) % GLOB_CACHE_BUCKETS;
+    DirListing** link = &dirCache[bucket];
+    while (*link && ((*link)->ino != st.st_ino || (*link)->dev != st.st_dev)) link = &(*link)->next;
+    DirListing* listing = *link;
+
+    if (listing && listing->mtime.tv_sec == st.st_mtim.tv_sec && listing->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        // Within the mtime granularity a change right after the scan would go unnoticed
+        struct timespec trusted = listing->mtime;
+        trusted.tv_nsec += GLOB_RACY_NS;
+        if (trusted.tv_nsec >= 1000000000) {
+            trusted.tv_sec++;
+            trusted.tv_nsec -= 1000000000;
+        }
+        if (timespecBefore(trusted, listing->scanned)) {
+            globStats.hits++;
+            return listing;
+        }
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    if (listing) {
+        // The same directory can be listed again further down one expansion (through a
+        // symlink), so the stale listing is kept until the expansion is over
+        *link = listing->next;
+        listing->next = retiredListings;
+        retiredListings = listing;
+        dirCacheBytes -= listing->namesLen + listing->count * 5;
+    }
+    listing = memCalloc(MEM_GLOB, 1, sizeof(DirListing));
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->next = dirCache[bucket];
+    dirCache[bucket] = listing;
+    listing->mtime = st.st_mtim; // Taken before reading: a change meanwhile leaves a newer mtime
+    clock_gettime(CLOCK_REALTIME, &listing->scanned);
+    readDirEntries(fd, listing);
+    dirCacheBytes += listing->namesLen + listing->count * 5;
+    globStats.scans++;
+    return listing;
+}
+
+// Matches character c against the bracket expression at p. Returns the expression's
+// length, 0 if c is not in the set, or -1 if there is no closing ']' ('[' is then literal).
+int matchBracket(const char* p, unsigned char c) {
+    const char* q = p + 1;
+    int negate = (*q == '!' || *q == '^');
+    if (negate) q++;
+    int found = 0;
+    for (int first = 1; *q && (*q != ']' || first); first = 0) {
+        unsigned char low = *q;
+        if (low == '\\' && q[1]) low = *++q;
+        q++;
+        unsigned char high = low;
+        if (*q == '-' && q[1] && q[1] != ']') {
+            high = *++q;
+            if (high == '\\' && q[1]) high = *++q;
+            q++;
+        }
+        if (low <= c && c <= high) found = 1;
+    }
+    if (*q != ']') return -1;
+    return found != negate ? (int)(q + 1 - p) : 0;
+}
+
+// Matches one path component against a pattern; '\' makes the next pattern byte literal
+int globMatch(const char* pattern, const char* name) {
+    const char* retryPattern = NULL;
+    const char* retryName = NULL;
+    while (*pattern || *name) {
+        if (*pattern == '*') {
+            while (*pattern == '*') pattern++;
+            retryPattern = pattern;
+            retryName = name;
+            continue;
+        }
+        if (*name) {
+            int step;
+            if (*pattern == '?') {
+                step = 1;
+            } else if (*pattern == '[') {
+                int len = matchBracket(pattern, *name);
+                step = len < 0 ? (*name == '[') : len;
+            } else if (*pattern == '\\' && pattern[1]) {
+                step = (pattern[1] == *name) ? 2 : 0;
+            } else {
+                step = (*pattern && *pattern == *name);
+            }
+            if (step) {
+                pattern += step;
+                name++;
+                continue;
+            }
+        }
+        // Mismatch: let the last '*' take one more character
+        if (!retryPattern || !*retryName) return 0;
+        pattern = retryPattern;
+        name = ++retryName;
+    }
+    return 1;
+}
+
+// Whether text has an unescaped '*', '?' or complete '[...]'
+int hasGlobSyntax(const char* text) {
+    for (; *text; text++) {
+        if (*text == '\\' && text[1]) text++;
+        else if (*text == '*' || *text == '?') return 1;
+        else if (*text == '[' && matchBracket(text, 0) >= 0) return 1;
+    }
+    return 0;
+}
+
+// Sorts strings byte-wise from byte 'depth' on. Multikey quicksort: every partition step
+// looks at one byte, so the long prefixes that paths in one directory share are not
+// compared over and over as with strcmp-based sorting.
+void sortPaths(char** paths, int count, size_t depth) {
+    while (count > 1) {
+        if (count < 16) {
+            for (int i = 1; i < count; i++) {
+                for (int j = i; j > 0 && strcmp(paths[j - 1] + depth, paths[j] + depth) > 0; j--) {
+                    char* swap = paths[j];
+                    paths[j] = paths[j - 1];
+                    paths[j - 1] = swap;
+                }
+            }
+            return;
+        }
+        int pivot = (unsigned char)paths[count / 2][depth];
+        int less = 0, i = 0, greater = count - 1;
+        while (i <= greater) {
+            int c = (unsigned char)paths[i][depth];
+            char* swap = paths[i];
+            if (c < pivot) {
+                paths[i++] = paths[less];
+                paths[less++] = swap;
+            } else if (c > pivot) {
+                paths[i] = paths[greater];
+                paths[greater--] = swap;
+            } else {
+                i++;
+            }
+        }
+        sortPaths(paths, less, depth);
+        if (pivot != 0) sortPaths(paths + less, greater - less + 1, depth + 1);
+        paths += greater + 1;
+        count -= greater + 1;
+    }
+}
+
+typedef struct {
+    Arena* arena;
+    char** paths;
+    int count, capacity;
+} GlobResult;
+
+void addGlobPath(GlobResult* result, char* path) {
+    if (result->count == result->capacity) {
+        result->capacity = result->capacity ? result->capacity * 2 : 16;
+        result->paths = memRealloc(MEM_GLOB, result->paths, result->capacity * sizeof(char*));
+    }
+    result->paths[result->count++] = path;
+}
+
+int isDirectoryEntry(DirListing* listing, uint32_t i, char* path) {
+    if (listing->types[i] == DT_DIR) return 1;
+    if (listing->types[i] != DT_UNKNOWN && listing->types[i] != DT_LNK) return 0;
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Expands parts[part...] below path[0..len), which is empty or ends in '/'
+void globComponents(GlobResult* result, char* path, size_t len, char** parts, int part, int partCount, int dirOnly) {
+    const char* pattern = parts[part];
+    int last = (part == partCount - 1);
+    int recursive = (strcmp(pattern, "**") == 0);
+
+    if (!recursive && !hasGlobSyntax(pattern)) {
+        // Literal component: no need to list the directory
+        size_t end = len;
+        for (const char* p = pattern; *p && end < GLOB_PATH_MAX - 2; p++) {
+            if (*p == '\\' && p[1]) p++;
+            path[end++] = *p;
+        }
+        path[end] = '\0';
+        struct stat st;
+        if (!last) {
+            path[end++] = '/';
+            path[end] = '\0';
+            globComponents(result, path, end, parts, part + 1, partCount, dirOnly);
+        } else if (dirOnly ? stat(path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(path, &st) == 0) {
+            if (dirOnly) strcpy(path + end, "/");
+            addGlobPath(result, arenaStrndup(result->arena, path, end + dirOnly));
+        }
+        return;
+    }
+    if (recursive && !last) {
+        // '**' matching no directory at all
+        globComponents(result, path, len, parts, part + 1, partCount, dirOnly);
+    }
+
+    path[len] = '\0';
+    DirListing* listing = listDirectory(len ? path : ".");
+    if (!listing) return;
+    for (uint32_t i = 0; i < listing->count; i++) {
+        const char* name = listing->names + listing->nameOffsets[i];
+        // Hidden entries only match a pattern that starts with '.'
+        if (name[0] == '.' && pattern[0] != '.') continue;
+        if (!recursive && !globMatch(pattern, name)) continue;
+        size_t nameLen = strlen(name);
+        if (len + nameLen + 2 >= GLOB_PATH_MAX) continue;
+        memcpy(path + len, name, nameLen + 1);
+        size_t end = len + nameLen;
+
+        if (last && (!dirOnly || isDirectoryEntry(listing, i, path))) {
+            if (dirOnly) path[end] = '/';
+            addGlobPath(result, arenaStrndup(result->arena, path, end + dirOnly));
+        }
+        // '**' descends into every directory (not through symlinks); other patterns
+        // descend into the directories they matched when more components follow
+        int descend = recursive ? listing->types[i] == DT_DIR ||
+                                  (listing->types[i] == DT_UNKNOWN && isDirectoryEntry(listing, i, path))
+                                : !last && isDirectoryEntry(listing, i, path);
+        if (descend) {
+            path[end] = '/';
+            path[end + 1] = '\0';
+            globComponents(result, path, end + 1, parts, recursive ? part : part + 1, partCount, dirOnly);
+        }
+        path[len] = '\0';
+    }
+}
+
+// Adds the paths matching pattern to result, sorted; returns how many were added
+int expandGlob(GlobResult* result, const char* pattern) {
+    freeDirListings(&retiredListings);
+    if (dirCacheBytes > GLOB_CACHE_LIMIT) flushDirCache();
+
+    char copy[GLOB_PATH_MAX];
+    char* parts[GLOB_PATH_MAX / 2];
+    int partCount = 0;
+    size_t patternLen = strlen(pattern);
+    if (patternLen >= GLOB_PATH_MAX) return 0;
+    memcpy(copy, pattern, patternLen + 1);
+    for (char* p = strtok(copy, "/"); p; p = strtok(NULL, "/")) {
+        parts[partCount++] = p;
+    }
+    if (partCount == 0) return 0;
+
+    char path[GLOB_PATH_MAX];
+    size_t len = 0;
+    if (pattern[0] == '/') path[len++] = '/';
+    int start = result->count;
+    globComponents(result, path, len, parts, 0, partCount, pattern[patternLen - 1] == '/');
+    sortPaths(result->paths + start, result->count - start, 0);
+    return result->count - start;
+}
+
+// Replaces glob patterns in the commands' arguments with the paths they match; a pattern
+// that matches nothing is kept as written. Runs just before the commands start, so files
+// created earlier on the same line are seen. MAX_ARGS was checked before, on the patterns.
+void expandCommandGlobs(Arena* arena, Command* commands, int count) {
+    for (int c = 0; c < count; c++) {
+        Command* cmd = &commands[c];
+        if (!cmd->globs) continue;
+        GlobResult result = {arena, NULL, 0, 0};
+        for (int i = 0; i < cmd->argc; i++) {
+            if (!cmd->globs[i] || expandGlob(&result, cmd->globs[i]) == 0) {
+                addGlobPath(&result, cmd->argv[i]);
+            }
+        }
+        cmd->argv = arenaAlloc(arena, (result.count + 1) * sizeof(char*));
+        memcpy(cmd->argv, result.paths, result.count * sizeof(char*));
+        cmd->argv[result.count] = NULL;
+        cmd->argc = result.count;
+        cmd->globs = NULL;
+        memFree(result.paths);
+    }
+}
+
+
+// Open redirection targets, so a script that appends to the same log on every line does
+// not resolve and open its path each time: '>>' targets are handed out as dups of one
+// O_APPEND descriptor (every write goes to the end, so sharing it is safe). A '<' target
+// shares its file offset with every dup, so only commands running inside the shell, one at
+// a time, read it from the cache (rewound first); children open their own.
+// An entry is dropped when inotify reports its file renamed or unlinked, and its path is
+// stat'ed again every REDIR_RECHECK_SECS to catch anything else (e.g. a renamed directory).
+typedef struct {
+    char* path;             // Absolute path, NULL for a free slot
+    int input;              // '<' reader rather than '>>' writer
+    int fd;                 // Close-on-exec
+    int watch;              // inotify watch descriptor
+    dev_t dev;
+    ino_t ino;
+    time_t checked;         // Last time path was stat'ed
+    unsigned long hits;
+    uint64_t lastUsed;
+} RedirEntry;
+
+struct {
+    RedirEntry entries[REDIR_CACHE_SIZE];
+    int inotifyFd;
+    pid_t owner;            // Process the cache belongs to; 0 until first use, -1 in a child shell
+    uint64_t clock;
+    int cwdGeneration;      // Generation cwd was read at
+    char cwd[GLOB_PATH_MAX];
+    unsigned long hits, misses, dropped;
+} redirCache = {.inotifyFd = -1, .cwdGeneration = -1};
+int cwdGeneration = 0;      // Bumped on every change of directory
+
+void dropRedirEntry(RedirEntry* entry, int unwatch) {
+    if (unwatch && entry->watch >= 0) inotify_rm_watch(redirCache.inotifyFd, entry->watch);
+    close(entry->fd);
+    memFree(entry->path);
+    entry->path = NULL;
+}
+
+// Closes every cached target; 'redir --flush'
+void flushRedirCache() {
+    for (int i = 0; i < REDIR_CACHE_SIZE; i++) {
+        if (redirCache.entries[i].path) dropRedirEntry(&redirCache.entries[i], 1);
+    }
+}
+
+// A child shell keeps none of the parent's targets, must not touch its inotify watches and
+// opens its own targets without caching them
+void forgetRedirCache() {
+    for (int i = 0; i < REDIR_CACHE_SIZE; i++) {
+        if (redirCache.entries[i].path) dropRedirEntry(&redirCache.entries[i], 0);
+    }
+    if (redirCache.inotifyFd >= 0) close(redirCache.inotifyFd);
+    redirCache.inotifyFd = -1;
+    redirCache.owner = -1;
+}
+
+// Drops the entries whose files were renamed or unlinked since the last lookup
+void readRedirEvents() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(redirCache.inotifyFd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            for (int i = 0; i < REDIR_CACHE_SIZE; i++) {
+                RedirEntry* entry = &redirCache.entries[i];
+                if (!entry->path || entry->watch != event->wd) continue;
+                struct stat st;
+                // IN_ATTRIB is also chmod or touch; only a lost link matters
+                if ((event->mask & IN_ATTRIB) && fstat(entry->fd, &st) == 0 && st.st_nlink > 0) continue;
+                dropRedirEntry(entry, 1);
+                redirCache.dropped++;
+            }
+        }
+    }
+}
+
+// Absolute form of path in buf, or NULL when it does not fit
+const char* resolveRedirPath(const char* path, char* buf, size_t size) {
+    if (path[0] == '/') return path;
+    if (redirCache.cwdGeneration != cwdGeneration) {
+        if (getcwd(redirCache.cwd, sizeof(redirCache.cwd)) == NULL) return NULL;
+        redirCache.cwdGeneration = cwdGeneration;
+    }
+    int len = snprintf(buf, size, "%s/%s", redirCache.cwd, path);
+    return len < (int)size ? buf : NULL;
+}
+
+// Returns the cached descriptor of a '>>' (input 0) or '<' (input 1) target, opening and
+// adding it on a miss; -1 when the target is not cached, and the caller opens it itself.
+int cachedRedirectionFd(const char* path, int input) {
+    if (!redirCacheEnabled || strncmp(path, "/proc/", 6) == 0) return -1; // /proc/self differs per process
+    if (redirCache.owner != 0 && redirCache.owner != getpid()) return -1; // A forked child
+    char buf[GLOB_PATH_MAX];
+    const char* key = resolveRedirPath(path, buf, sizeof(buf));
+    if (key == NULL) return -1;
+    if (redirCache.owner) readRedirEvents();
+
+    time_t now = time(NULL);
+    RedirEntry* slot = NULL;
+    for (int i = 0; i < REDIR_CACHE_SIZE; i++) {
+        RedirEntry* entry = &redirCache.entries[i];
+        if (!entry->path) {
+            if (!slot || slot->path) slot = entry;
+            continue;
+        }
+        if (entry->input != input || strcmp(entry->path, key) != 0) {
+            if (!slot || (slot->path && entry->lastUsed < slot->lastUsed)) slot = entry;
+            continue;
+        }
+        if (now - entry->checked >= REDIR_RECHECK_SECS) {
+            struct stat st;
+            entry->checked = now;
+            if (stat(key, &st) < 0 || st.st_dev != entry->dev || st.st_ino != entry->ino) {
+                dropRedirEntry(entry, 1);
+                redirCache.dropped++;
+                slot = entry;
+                break;
+            }
+        }
+        entry->hits++;
+        entry->lastUsed = ++redirCache.clock;
+        redirCache.hits++;
+        return entry->fd;
+    }
+
+    if (redirCache.owner == 0) {
+        redirCache.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        redirCache.owner = getpid();
+    }
+    if (redirCache.inotifyFd < 0) return -1;
+    int flags = input ? O_RDONLY : O_WRONLY | O_CREAT | O_APPEND;
+    int fd = open(key, flags | O_CLOEXEC, 0666);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return -1; // The caller's own open reports the error
+    }
+    redirCache.misses++;
+    if (slot->path) dropRedirEntry(slot, 1);
+    slot->path = memStrdup(MEM_REDIR, key);
+    slot->input = input;
+    slot->fd = fd;
+    slot->watch = inotify_add_watch(redirCache.inotifyFd, key, IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->checked = now;
+    slot->hits = 0;
+    slot->lastUsed = ++redirCache.clock;
+    return fd;
+}
+
+// Handles 'redir' (list the cached targets) and 'redir --flush' (close them)
+int redirBuiltin(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "--flush") == 0) {
+        flushRedirCache();
+        redirCache.hits = redirCache.misses = redirCache.dropped = 0;
+        return 0;
+    }
+    if (argc > 1) {
+        printf("redir: usage: redir [--flush]\n");
+        return 1;
+    }
+    if (redirCache.owner == getpid()) readRedirEvents();
+    printf("hits\top\ttarget\n");
+    for (int i = 0; i < REDIR_CACHE_SIZE; i++) {
+        RedirEntry* entry = &redirCache.entries[i];
+        if (entry->path) printf("%4lu\t%s\t%s\n", entry->hits, entry->input ? "<" : ">>", entry->path);
+    }
+    unsigned long lookups = redirCache.hits + redirCache.misses;
+    printf("lookups: %lu hits, %lu misses (%.1f%% hit rate), %lu dropped as stale\n", redirCache.hits,
+           redirCache.misses, lookups ? 100.0 * redirCache.hits / lookups : 0.0, redirCache.dropped);
+    return 0;
+}
+
+// Named in-memory buffers: '@name' as a '<', '>', '>>' or '>|' target or a '#' operand is a
+// memfd the shell holds, so intermediate results of a script never touch a filesystem.
+// Before a pipeline starts, each '@name' is replaced by /proc/self/fd/N of its memfd, so
+// opening it works the same in the shell, in a forked stage and in posix_spawn's file
+// actions, and every open gets its own file offset like a regular file would.
+typedef struct NamedBuffer {
+    char* name;             // Without the '@'
+    int fd;                 // memfd, close-on-exec
+    struct NamedBuffer* next;
+} NamedBuffer;
+
+NamedBuffer* bufferList = NULL;
+
+int isBufferName(const char* text) {
+    return text && text[0] == '@' && text[1] != '\0' && strchr(text, '/') == NULL;
+}
+
+NamedBuffer* findBuffer(const char* name) {
+    for (NamedBuffer* buffer = bufferList; buffer; buffer = buffer->next) {
+        if (strcmp(buffer->name, name) == 0) return buffer;
+    }
+    return NULL;
+}
+
+off_t bufferSize(NamedBuffer* buffer) {
+    struct stat st;
+    return fstat(buffer->fd, &st) == 0 ? st.st_size : 0;
+}
+
+off_t totalBufferBytes() {
+    off_t total = 0;
+    for (NamedBuffer* buffer = bufferList; buffer; buffer = buffer->next) total += bufferSize(buffer);
+    return total;
+}
+
+// Path that opens the buffer named by target ('@name'). A write target (outputMode set)
+// creates the buffer, and is refused once the buffers hold 'set buffercap' bytes; the
+// command that crosses the cap still finishes. NULL after reporting an error.
+char* bufferPath(Arena* arena, const char* target, int outputMode) {
+    NamedBuffer* buffer = findBuffer(target + 1);
+    if (buffer == NULL && !outputMode) {
+        printf("shell24: %s: no such buffer\n", target);
+        return NULL;
+    }
+    if (outputMode && bufferCap > 0) {
+        off_t used = totalBufferBytes();
+        if (buffer && outputMode == OUTPUT_TRUNC) used -= bufferSize(buffer);
+        if (used >= bufferCap) {
+            printf("shell24: %s: buffers are full (set buffercap %ld); drop one first\n", target, bufferCap);
+            return NULL;
+        }
+    }
+    if (buffer == NULL) {
+        int fd = memfd_create(target + 1, MFD_CLOEXEC);
+        if (fd < 0) {
+            perror("memfd_create");
+            return NULL;
+        }
+        buffer = memAlloc(MEM_BUFFERS, sizeof(NamedBuffer));
+        buffer->name = memStrdup(MEM_BUFFERS, target + 1);
+        buffer->fd = fd;
+        buffer->next = bufferList;
+        bufferList = buffer;
+    }
+    char* path = arenaAlloc(arena, 32);
+    snprintf(path, 32, "/proc/self/fd/%d", buffer->fd);
+    return path;
+}
+
+int usesBuffers(Command* cmd) {
+    if (isBufferName(cmd->fileIP) || isBufferName(cmd->fileOP)) return 1;
+    for (int i = 0; i < cmd->teeCount; i++) {
+        if (isBufferName(cmd->teeFiles[i])) return 1;
+    }
+    for (int i = 0; cmd->isConcat && i < cmd->argc; i++) {
+        if (isBufferName(cmd->argv[i])) return 1;
+    }
+    return 0;
+}
+
+// Replaces the '@name' targets and '#' operands of the commands with their buffers' paths.
+// Returns -1 (the error is printed) when one cannot be used.
+int resolveBufferTargets(Arena* arena, Command* commands, int count) {
+    for (int c = 0; c < count; c++) {
+        Command* cmd = &commands[c];
+        if (!usesBuffers(cmd)) continue;
+        if (isBufferName(cmd->fileIP) && !(cmd->fileIP = bufferPath(arena, cmd->fileIP, 0))) return -1;
+        if (isBufferName(cmd->fileOP) && !(cmd->fileOP = bufferPath(arena, cmd->fileOP, cmd->outputMode))) return -1;
+        if (cmd->teeCount) {
+            char** tees = arenaAlloc(arena, cmd->teeCount * sizeof(char*));
+            for (int i = 0; i < cmd->teeCount; i++) {
+                tees[i] = cmd->teeFiles[i];
+                if (isBufferName(tees[i]) && !(tees[i] = bufferPath(arena, tees[i], OUTPUT_TRUNC))) return -1;
+            }
+            cmd->teeFiles = tees;
+        }
+        if (cmd->isConcat) {
+            char** argv = arenaAlloc(arena, (cmd->argc + 1) * sizeof(char*));
+            for (int i = 0; i <= cmd->argc; i++) {
+                argv[i] = cmd->argv[i];
+                if (isBufferName(argv[i]) && !(argv[i] = bufferPath(arena, argv[i], 0))) return -1;
+            }
+            cmd->argv = argv;
+        }
+    }
+    return 0;
+}
+
+// Handles 'buffers': each '@name' buffer with its size, then the total and the cap
+int buffersBuiltin(int argc, char** argv) {
+    printf("bytes\tbuffer\n");
+    for (NamedBuffer* buffer = bufferList; buffer; buffer = buffer->next) {
+        printf("%lld\t@%s\n", (long long)bufferSize(buffer), buffer->name);
+    }
+    printf("total: %lld bytes", (long long)totalBufferBytes());
+    if (bufferCap > 0) printf(" of %ld", bufferCap);
+    printf("\n");
+    return 0;
+}
+
+// Handles 'drop @name...': frees the buffers (commands still reading one keep it until they finish)
+int dropBuiltin(int argc, char** argv) {
+    if (argc < 2) {
+        printf("drop: usage: drop @name...\n");
+        return 1;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        const char* name = argv[i][0] == '@' ? argv[i] + 1 : argv[i];
+        NamedBuffer** link = &bufferList;
+        while (*link && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+        if (*link == NULL) {
+            printf("drop: @%s: no such buffer\n", name);
+            status = 1;
+            continue;
+        }
+        NamedBuffer* buffer = *link;
+        *link = buffer->next;
+        close(buffer->fd);
+        memFree(buffer->name);
+        memFree(buffer);
+    }
+    return status;
+}
+
+// Opens the '<', '>' and '>>' targets onto stdin and stdout; inShell is set for a command
+// running inside the shell itself. Returns -1 after reporting the error when a file cannot
+// be opened.
+int openRedirections(const char* fileIP, const char* fileOP, int outputMode, int inShell) {
+    int fd_in, fd_out;
+
+    // Setup input redirection
+    if (fileIP) {
+        fd_in = inShell ? cachedRedirectionFd(fileIP, 1) : -1;
+        if (fd_in >= 0) {
+            lseek(fd_in, 0, SEEK_SET);
+            dup2(fd_in, STDIN_FILENO);
+        } else {
+            fd_in = open(fileIP, O_RDONLY);
+            if (fd_in < 0) {
+                perror("Failed to open input file");
+                return -1;
+            }
+            dup2(fd_in, STDIN_FILENO);
+            close(fd_in);
+        }
+    }
+
+    // Setup output redirection
+    if (fileOP) {
+        fd_out = inShell && outputMode == OUTPUT_APPEND ? cachedRedirectionFd(fileOP, 0) : -1;
+        if (fd_out >= 0) {
+            dup2(fd_out, STDOUT_FILENO);
+            return 0;
+        }
+        if (outputMode == OUTPUT_TRUNC) {
+            fd_out = open(fileOP, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        } else { // OUTPUT_APPEND
+            fd_out = open(fileOP, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        }
+        if (fd_out < 0) {
+            perror("Failed to open output file");
+            return -1;
+        }
+        dup2(fd_out, STDOUT_FILENO);
+        close(fd_out);
+    }
+    return 0;
+}
+
+// Applies '<', '>' and '>>' redirections inside an already forked child
+void applyRedirections(const char* fileIP, const char* fileOP, int outputMode) {
+    if (openRedirections(fileIP, fileOP, outputMode, 0) < 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Puts the original stdin/stdout back after redirectShellFds
+void restoreShellFds(int saved[2]) {
+    fflush(stdout);
+    for (int fd = 0; fd < 2; fd++) {
+        if (saved[fd] >= 0) {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+            saved[fd] = -1;
+        }
+    }
+}
+
+// Redirects the shell's own stdin/stdout for a command that runs inside the shell. The
+// original descriptors are kept in saved (close-on-exec) until restoreShellFds.
+int redirectShellFds(const char* fileIP, const char* fileOP, int outputMode, int saved[2]) {
+    saved[0] = saved[1] = -1;
+    if (fileIP == NULL && fileOP == NULL) return 0;
+    fflush(stdout);
+    if (fileIP) saved[0] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+    if (fileOP) saved[1] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    if (openRedirections(fileIP, fileOP, outputMode, 1) < 0) {
+        restoreShellFds(saved);
+        return -1;
+    }
+    return 0;
+}
+
+// One resolved command name; path is NULL for a negative (not found) entry
+typedef struct PathCacheEntry {
+    char* name;
+    char* path;
+    int dirIndex;        // $PATH directory the command was found in, -1 when not found
+    unsigned long hits;
+    struct PathCacheEntry* next;
+} PathCacheEntry;
+
+// Resolved-path table so repeated commands skip the $PATH search done by execvp
+struct {
+    PathCacheEntry* buckets[PATH_CACHE_BUCKETS];
+    char* pathValue;        // $PATH the table was built for
+    char** dirs;            // $PATH split into directories
+    struct timespec* dirMtimes;
+    int dirCount;
+    time_t lastChecked;     // Last time the directory mtimes were compared
+    unsigned long hits, misses;
+} pathCache;
+
+unsigned int hashCommandName(const char* name) {
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h % PATH_CACHE_BUCKETS;
+}
+
+// Drops cached entries; with minDir >= 0 only entries that a change in that directory can affect
+void flushPathCache(int minDir) {
+    for (int b = 0; b < PATH_CACHE_BUCKETS; b++) {
+        PathCacheEntry** link = &pathCache.buckets[b];
+        while (*link) {
+            PathCacheEntry* entry = *link;
+            // A new binary in dir N can shadow anything found in dir >= N or not found at all
+            if (minDir < 0 || entry->dirIndex < 0 || entry->dirIndex >= minDir) {
+                *link = entry->next;
+                memFree(entry->name);
+                memFree(entry->path);
+                memFree(entry);
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+// Splits a new $PATH value into directories and records their mtimes
+void loadPathDirectories(const char* pathValue) {
+    for (int i = 0; i < pathCache.dirCount; i++) {
+        memFree(pathCache.dirs[i]);
+    }
+    memFree(pathCache.dirs);
+    memFree(pathCache.dirMtimes);
+    memFree(pathCache.pathValue);
+
+    pathCache.pathValue = memStrdup(MEM_PATH, pathValue);
+    pathCache.dirCount = 1;
+    for (const char* c = pathValue; *c; c++) {
+        if (*c == ':') pathCache.dirCount++;
+    }
+    pathCache.dirs = memAlloc(MEM_PATH, pathCache.dirCount * sizeof(char*));
+    pathCache.dirMtimes = memCalloc(MEM_PATH, pathCache.dirCount, sizeof(struct timespec));
+
+    const char* start = pathValue;
+    for (int i = 0; i < pathCache.dirCount; i++) {
+        const char* end = strchr(start, ':');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        // An empty $PATH element means the current directory
+        pathCache.dirs[i] = len ? memStrndup(MEM_PATH, start, len) : memStrdup(MEM_PATH, ".");
+        struct stat st;
+        if (stat(pathCache.dirs[i], &st) == 0) {
+            pathCache.dirMtimes[i] = st.st_mtim;
+        }
+        start = end ? end + 1 : start + len;
+    }
+    pathCache.lastChecked = time(NULL);
+}
+
+// Invalidates the table when $PATH changed or one of its directories was modified
+void validatePathCache() {
+    const char* pathValue = getenv("PATH");
+    if (pathValue == NULL) {
+        pathValue = "/usr/bin:/bin";
+    }
+    if (pathCache.pathValue == NULL || strcmp(pathCache.pathValue, pathValue) != 0) {
+        flushPathCache(-1);
+        loadPathDirectories(pathValue);
+        return;
+    }
+
+    // Stat the directories only on a slow cadence so tight loops do no probing at all
+    time_t now = time(NULL);
+    if (now - pathCache.lastChecked < PATH_CACHE_RECHECK_SECS) {
+        return;
+    }
+    pathCache.lastChecked = now;
+    for (int i = 0; i < pathCache.dirCount; i++) {
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (stat(pathCache.dirs[i], &st) == 0) {
+            mtime = st.st_mtim;
+        }
+        if (mtime.tv_sec != pathCache.dirMtimes[i].tv_sec || mtime.tv_nsec != pathCache.dirMtimes[i].tv_nsec) {
+            pathCache.dirMtimes[i] = mtime;
+            flushPathCache(i);
+        }
+    }
+}
+
+// Searches $PATH for an executable and adds the result (or a negative entry) to the table
+PathCacheEntry* searchPathDirectories(const char* name, unsigned int bucket) {
+    PathCacheEntry* entry = memCalloc(MEM_PATH, 1, sizeof(PathCacheEntry));
+    entry->name = memStrdup(MEM_PATH, name);
+    entry->dirIndex = -1;
+
+    for (int i = 0; i < pathCache.dirCount; i++) {
+        size_t len = strlen(pathCache.dirs[i]) + strlen(name) + 2;
+        char* candidate = memAlloc(MEM_PATH, len);
+        snprintf(candidate, len, "%s/%s", pathCache.dirs[i], name);
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            entry->path = candidate;
+            entry->dirIndex = i;
+            break;
+        }
+        memFree(candidate);
+    }
+
+    entry->next = pathCache.buckets[bucket];
+    pathCache.buckets[bucket] = entry;
+    return entry;
+}
+
+// Resolves a command name to an absolute path, or NULL if it is not on $PATH.
+// Names containing '/' are used as given, like execvp does.
+const char* resolveCommandPath(const char* name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    validatePathCache();
+
+    unsigned int bucket = hashCommandName(name);
+    for (PathCacheEntry* entry = pathCache.buckets[bucket]; entry; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            pathCache.hits++;
+            entry->hits++;
+            return entry->path;
+        }
+    }
+    pathCache.misses++;
+    return searchPathDirectories(name, bucket)->path;
+}
+
+// Forgets one name, e.g. after its cached binary disappeared
+void forgetCommandPath(const char* name) {
+    PathCacheEntry** link = &pathCache.buckets[hashCommandName(name)];
+    while (*link) {
+        PathCacheEntry* entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            memFree(entry->name);
+            memFree(entry->path);
+            memFree(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+// Replaces the current (child) process with the command, using the resolved path
+void execResolvedCommand(char** argv) {
+    const char* path = resolveCommandPath(argv[0]);
+    if (path != NULL) {
+        execv(path, argv);
+    } else {
+        errno = ENOENT;
+    }
+    printf("%s", argv[0]);
+    perror("Failed to execute command");
+    exit(EXIT_FAILURE);
+}
+
+uint64_t monotonicMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Latency histogram in microseconds with log-linear (HDR style) buckets: every power of
+// two is split into 16 equal steps, so a percentile is accurate to within 1/16
+typedef struct {
+    uint32_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count, max;
+} Histogram;
+
+int histogramBucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return (int)value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    int index = (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// Smallest value that falls into a bucket
+uint64_t histogramBucketValue(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) return index;
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    return (uint64_t)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+void histogramRecord(Histogram* h, uint64_t value) {
+    h->counts[histogramBucket(value)]++;
+    h->count++;
+    if (value > h->max) h->max = value;
+}
+
+uint64_t histogramPercentile(Histogram* h, double percent) {
+    uint64_t rank = (uint64_t)(percent / 100.0 * h->count + 0.5);
+    uint64_t seen = 0;
+    if (rank < 1) rank = 1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS && h->count; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = histogramBucketValue(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Latencies of every command run under one name, shown by 'stats'
+typedef struct CommandStats {
+    char* name;
+    Histogram parse;    // Parsing the line the command was on
+    Histogram spawn;    // Starting the process (0 for builtins run in the shell)
+    Histogram run;      // From start until it was reaped
+    struct CommandStats* next;
+} CommandStats;
+
+CommandStats* statsTable[PATH_CACHE_BUCKETS]; // Hashed like the PATH cache
+
+CommandStats* findCommandStats(const char* name) {
+    unsigned int bucket = hashCommandName(name);
+    for (CommandStats* stats = statsTable[bucket]; stats; stats = stats->next) {
+        if (strcmp(stats->name, name) == 0) return stats;
+    }
+    CommandStats* stats = memCalloc(MEM_STATS, 1, sizeof(CommandStats));
+    stats->name = memStrdup(MEM_STATS, name);
+    stats->next = statsTable[bucket];
+    statsTable[bucket] = stats;
+    return stats;
+}
+
+// When and how one process of a job was started
+typedef struct {
+    CommandStats* stats;    // NULL for a process that was never started
+    uint64_t parseUs, spawnUs;
+    uint64_t startUs;       // monotonicMicros() once the process was running
+} ProcessTiming;
+
+// Resources of the children reaped so far; 'time' looks at the difference
+struct rusage childUsage;
+
+void accountChildUsage(const struct rusage* usage) {
+    timeradd(&childUsage.ru_utime, &usage->ru_utime, &childUsage.ru_utime);
+    timeradd(&childUsage.ru_stime, &usage->ru_stime, &childUsage.ru_stime);
+    childUsage.ru_nvcsw += usage->ru_nvcsw;
+    childUsage.ru_nivcsw += usage->ru_nivcsw;
+    if (usage->ru_maxrss > childUsage.ru_maxrss) childUsage.ru_maxrss = usage->ru_maxrss;
+}
+
+uint64_t timevalMicros(struct timeval tv) {
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void writeJsonString(FILE* fp, const char* text) {
+    fputc('"', fp);
+    for (const unsigned char* p = (const unsigned char*)text; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(fp, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(fp, "\\u%04x", *p);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// Writes one trace line for a finished command; usage is NULL for builtins run in the shell
+void traceCommand(const ProcessTiming* timing, const char* line, pid_t pid, int status,
+                  uint64_t runUs, const struct rusage* usage) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(traceFile, "{\"time\": %ld.%06ld, \"pid\": %d, \"command\": ", (long)now.tv_sec, now.tv_nsec / 1000, (int)pid);
+    writeJsonString(traceFile, timing->stats->name);
+    fprintf(traceFile, ", \"line\": ");
+    if (line) {
+        writeJsonString(traceFile, line);
+    } else {
+        fprintf(traceFile, "null");
+    }
+    fprintf(traceFile, ", \"status\": %d, \"signal\": %d, \"parse_us\": %llu, \"spawn_us\": %llu, \"run_us\": %llu",
+            WIFEXITED(status) ? WEXITSTATUS(status) : -1, WIFSIGNALED(status) ? WTERMSIG(status) : 0,
+            (unsigned long long)timing->parseUs, (unsigned long long)timing->spawnUs, (unsigned long long)runUs);
+    if (usage) {
+        fprintf(traceFile, ", \"user_us\": %llu, \"sys_us\": %llu, \"maxrss_kb\": %ld, \"nvcsw\": %ld, \"nivcsw\": %ld",
+                (unsigned long long)timevalMicros(usage->ru_utime), (unsigned long long)timevalMicros(usage->ru_stime),
+                usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+    }
+    fprintf(traceFile, "}\n");
+}
+
+// Starts the clock for a command; spawnStartUs is when its launch began
+void startProcessTiming(ProcessTiming* timing, Command* cmd, uint64_t spawnStartUs) {
+    timing->startUs = monotonicMicros();
+    timing->stats = findCommandStats(cmd->isConcat ? "#" : cmd->argv[0]);
+    timing->parseUs = lineParseUs;
+    timing->spawnUs = timing->startUs - spawnStartUs;
+}
+
+// Records how long a command ran, in 'stats' and in the trace
+void finishProcessTiming(ProcessTiming* timing, const char* line, pid_t pid, int status,
+                         const struct rusage* usage) {
+    if (timing->stats == NULL) return;
+    uint64_t runUs = monotonicMicros() - timing->startUs;
+    histogramRecord(&timing->stats->parse, timing->parseUs);
+    histogramRecord(&timing->stats->spawn, timing->spawnUs);
+    histogramRecord(&timing->stats->run, runUs);
+    if (traceFile) {
+        traceCommand(timing, line, pid, status, runUs, usage);
+    }
+    timing->stats = NULL;
+}
+
+// A foreground or background pipeline and the processes that belong to it
+typedef struct Job {
+    int id;             // Number used as %n; 0 while the job runs in the foreground
+    pid_t pgid;         // Process group, 0 when the job shares the shell's group
+    pid_t* pids;
+    int* statuses;      // Wait status of each process once it exited
+    ProcessTiming* timings;
+    int pidCount;
+    int pidCapacity;
+    int running;        // Processes that have not exited yet
+    int stopped;
+    int ownGroup;       // Processes are put in a process group of their own
+    char* command;      // Command text shown by 'jobs'
+    char* line;         // Source line the job came from, for the trace (NULL without SHELL24_TRACE)
+    char* cgroup;       // Leaf cgroup of a 'run' pipeline, removed with the job
+    long timeoutMs;     // Deadline as given, for messages
+    long killAfterMs;   // SIGTERM to SIGKILL once the deadline passed
+    uint64_t deadlineUs; // monotonicMicros() when the job gets SIGTERM, 0 for no deadline
+    uint64_t killUs;    // When it gets SIGKILL after that, 0 once sent
+    int timedOut;       // SIGTERM was sent; the job's status is TIMEOUT_EXIT_STATUS
+    struct Job* next;
+} Job;
+
+Job* jobList = NULL;                   // Background and stopped jobs, in id order
+int jobControl = 0;                    // Interactive: jobs get process groups and the terminal
+pid_t shellPgid = 0;
+int sigchldPipe[2] = {-1, -1};         // Self-pipe written by the SIGCHLD handler
+int captureFd = -1;                    // memfd that '$(...)' output is written to, created on first use
+volatile sig_atomic_t childExited = 0; // Set by the handler so idle checks cost no syscall
+int superviseFd = -1;                  // epoll set of sigchldPipe[0] and deadlineTimerFd
+int deadlineTimerFd = -1;              // timerfd armed for the next deadline of a waited-for job
+
+void handleSigchld(int sig) {
+    int savedErrno = errno;
+    childExited = 1;
+    if (sigchldPipe[1] >= 0) {
+        write(sigchldPipe[1], "", 1); // Non-blocking; a full pipe already means "wake up"
+    }
+    errno = savedErrno;
+}
+
+// Signals the shell ignores for job control must be back to default in every child
+void resetChildSignals() {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+}
+
+// Installs the SIGCHLD self-pipe and, for an interactive terminal, takes over job control
+void initJobControl(int interactive) {
+    if (sigchldPipe[0] >= 0) {
+        close(sigchldPipe[0]);
+        close(sigchldPipe[1]);
+    }
+    if (superviseFd >= 0) {
+        close(superviseFd); // Watches the old pipe; set up again when first needed
+        close(deadlineTimerFd);
+        superviseFd = deadlineTimerFd = -1;
+    }
+    if (pipe2(sigchldPipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("pipe");
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigchld;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (!interactive) return;
+    jobControl = 1;
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    shellPgid = getpid();
+    if (getpgrp() != shellPgid && setpgid(0, shellPgid) < 0) {
+        perror("setpgid");
+    }
+    tcsetpgrp(STDIN_FILENO, shellPgid);
+}
+
+// Prepares a forked child that keeps running shell code (a builtin stage, a '#' stage, a
+// 'parallel' line): default signals, no job control, and a SIGCHLD self-pipe of its own
+// so its children never wake the parent shell
+void becomeShellChild() {
+    resetChildSignals();
+    jobControl = 0;
+    childExited = 0;
+    jobList = NULL; // The parent's jobs are not this process's children
+    if (captureFd >= 0) {
+        close(captureFd); // Shared with the parent, which may be capturing into it
+        captureFd = -1;
+    }
+    forgetRedirCache();
+    initJobControl(0);
+}
+
+Job* createJob(int pidCapacity, int ownGroup) {
+    Job* job = memCalloc(MEM_JOBS, 1, sizeof(Job));
+    job->ownGroup = ownGroup;
+    job->pidCapacity = pidCapacity;
+    job->pids = memAlloc(MEM_JOBS, pidCapacity * sizeof(pid_t));
+    job->statuses = memCalloc(MEM_JOBS, pidCapacity, sizeof(int));
+    job->timings = memCalloc(MEM_JOBS, pidCapacity, sizeof(ProcessTiming));
+    if (traceFile && currentLine) job->line = memStrdup(MEM_JOBS, currentLine);
+    return job;
+}
+
+void freeJob(Job* job) {
+    memFree(job->pids);
+    memFree(job->statuses);
+    memFree(job->timings);
+    memFree(job->command);
+    memFree(job->line);
+    if (job->cgroup) {
+        rmdir(job->cgroup);
+        memFree(job->cgroup);
+    }
+    memFree(job);
+}
+
+// Makes room for one more process, e.g. a '>|' fan-out helper next to the stages
+void reserveJobProcess(Job* job) {
+    if (job->pidCount < job->pidCapacity) return;
+    int old = job->pidCapacity;
+    job->pidCapacity = old * 2 + 1;
+    job->pids = memRealloc(MEM_JOBS, job->pids, job->pidCapacity * sizeof(pid_t));
+    job->statuses = memRealloc(MEM_JOBS, job->statuses, job->pidCapacity * sizeof(int));
+    job->timings = memRealloc(MEM_JOBS, job->timings, job->pidCapacity * sizeof(ProcessTiming));
+    memset(job->statuses + old, 0, (job->pidCapacity - old) * sizeof(int));
+    memset(job->timings + old, 0, (job->pidCapacity - old) * sizeof(ProcessTiming));
+}
+
+void addJobProcess(Job* job, pid_t pid) {
+    reserveJobProcess(job);
+    job->pids[job->pidCount++] = pid;
+    job->running++;
+    if (job->pgid == 0 && job->ownGroup) {
+        job->pgid = pid; // The first process leads the job's group
+    }
+}
+
+// Records a process that could not be started; it counts as failed
+void addFailedJobProcess(Job* job) {
+    reserveJobProcess(job);
+    job->pids[job->pidCount] = -1;
+    job->statuses[job->pidCount++] = EXIT_FAILURE << 8;
+}
+
+// Builds the text shown for a job from its commands
+char* describeCommands(Command* commands, int count) {
+    size_t len = 1;
+    for (int i = 0; i < count; i++) {
+        for (int a = 0; a < commands[i].argc; a++) len += strlen(commands[i].argv[a]) + 3;
+        len += 4; // Operator after the command
+    }
+    char* text = memAlloc(MEM_JOBS, len);
+    char* p = text;
+    for (int i = 0; i < count; i++) {
+        for (int a = 0; a < commands[i].argc; a++) {
+            if (a > 0) p += sprintf(p, commands[i].isConcat ? " # " : " ");
+            p += sprintf(p, "%s", commands[i].argv[a]);
+        }
+        if (i < count - 1) {
+            p += sprintf(p, commands[i].next == TOK_AND ? " && " : commands[i].next == TOK_OR ? " || " : " | ");
+        }
+    }
+    *p = '\0';
+    return text;
+}
+
+// Wait status of a finished job: the last process, or with pipefail the rightmost failure.
+// A job stopped by its deadline exits with TIMEOUT_EXIT_STATUS.
+int jobStatus(Job* job) {
+    if (job->timedOut) return TIMEOUT_EXIT_STATUS << 8;
+    int result = 0;
+    for (int i = 0; i < job->pidCount; i++) {
+        int status = job->statuses[i];
+        if (pipefailEnabled) {
+            if (status != 0) result = status; // Rightmost failure wins
+        } else if (i == job->pidCount - 1) {
+            result = status;
+        }
+    }
+    return result;
+}
+
+Job* findJobByPid(pid_t pid) {
+    for (Job* job = jobList; job; job = job->next) {
+        for (int i = 0; i < job->pidCount; i++) {
+            if (job->pids[i] == pid) return job;
+        }
+    }
+    return NULL;
+}
+
+// Records a wait4 result for one of the job's processes; usage is NULL when unknown
+void updateJobProcess(Job* job, pid_t pid, int status, const struct rusage* usage) {
+    if (WIFSTOPPED(status)) {
+        job->stopped = 1;
+        return;
+    }
+    if (WIFCONTINUED(status)) {
+        job->stopped = 0;
+        return;
+    }
+    for (int i = 0; i < job->pidCount; i++) {
+        if (job->pids[i] == pid) {
+            job->statuses[i] = status;
+            job->running--;
+            if (usage) accountChildUsage(usage);
+            finishProcessTiming(&job->timings[i], job->line, pid, status, usage);
+            return;
+        }
+    }
+}
+
+// Gives the job a number and puts it in the job table
+void addJob(Job* job) {
+    int id = 1;
+    Job** link = &jobList;
+    while (*link) {
+        id = (*link)->id + 1;
+        link = &(*link)->next;
+    }
+    job->id = id;
+    job->next = NULL;
+    *link = job;
+}
+
+void removeJob(Job* job) {
+    for (Job** link = &jobList; *link; link = &(*link)->next) {
+        if (*link == job) {
+            *link = job->next;
+            return;
+        }
+    }
+}
+
+// Collects every child that changed state since the last call. Runs from the main
+// loop (never from the signal handler), so foreground waits are not disturbed.
+void reapJobs() {
+    if (!childExited) return;
+    childExited = 0;
+    char drain[64];
+    while (read(sigchldPipe[0], drain, sizeof(drain)) > 0) ;
+
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        Job* job = findJobByPid(pid);
+        if (job) {
+            updateJobProcess(job, pid, status, &usage);
+        } else {
+            recordSessionExit(pid, status);
+        }
+    }
+}
+
+// Describes how a finished job ended, e.g. "Done" or "Exit 2"
+void printJobState(Job* job) {
+    if (job->running > 0) {
+        printf("[%d]  %-10s %s\n", job->id, job->stopped ? "Stopped" : "Running", job->command);
+        return;
+    }
+    int status = jobStatus(job);
+    char state[32];
+    if (WIFSIGNALED(status)) {
+        snprintf(state, sizeof(state), "Signal %d", WTERMSIG(status));
+    } else if (WEXITSTATUS(status) != 0) {
+        snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(status));
+    } else {
+        snprintf(state, sizeof(state), "Done");
+    }
+    printf("[%d]  %-10s %s\n", job->id, state, job->command);
+}
+
+// Reports (if report is set) and forgets finished background jobs; called before each prompt
+void notifyFinishedJobs(int report) {
+    reapJobs();
+    Job** link = &jobList;
+    while (*link) {
+        Job* job = *link;
+        if (job->running == 0) {
+            if (report) printJobState(job);
+            *link = job->next;
+            freeJob(job);
+        } else {
+            link = &job->next;
+        }
+    }
+}
+
+// Gives a job a deadline, counted from now; killAfterMs < 0 uses 'set killgrace'
+void setJobDeadline(Job* job, long timeoutMs, long killAfterMs) {
+    job->timeoutMs = timeoutMs;
+    job->killAfterMs = killAfterMs >= 0 ? killAfterMs : killGraceMs;
+    job->deadlineUs = monotonicMicros() + (uint64_t)timeoutMs * 1000;
+}
+
+void formatDuration(long ms, char* buf, size_t size) {
+    if (ms % 1000) snprintf(buf, size, "%ldms", ms);
+    else snprintf(buf, size, "%lds", ms / 1000);
+}
+
+// Sends SIGTERM to a job that is past its deadline, and SIGKILL if it is still there when
+// the grace period is over; the whole process group gets the signal. Both are reported on
+// stderr. Returns the time of the job's next deadline event, 0 if there is none.
+uint64_t enforceDeadline(Job* job, uint64_t now) {
+    if (!job->deadlineUs || !job->pgid || job->running == 0) return 0;
+    char after[32];
+    if (!job->timedOut) {
+        if (now < job->deadlineUs) return job->deadlineUs;
+        job->timedOut = 1;
+        kill(-job->pgid, SIGTERM);
+        if (job->stopped) kill(-job->pgid, SIGCONT); // A stopped process would never see it
+        job->killUs = now + (uint64_t)job->killAfterMs * 1000;
+        formatDuration(job->timeoutMs, after, sizeof(after));
+        fprintf(stderr, "shell24: '%s' timed out after %s, sent SIGTERM\n", job->command, after);
+    }
+    if (job->killUs && now >= job->killUs) {
+        kill(-job->pgid, SIGKILL);
+        job->killUs = 0;
+        formatDuration(job->killAfterMs, after, sizeof(after));
+        fprintf(stderr, "shell24: '%s' still running %s after SIGTERM, sent SIGKILL\n", job->command, after);
+    }
+    return job->killUs;
+}
+
+// Applies the deadlines of background jobs; returns the earliest next event, 0 for none
+uint64_t enforceJobDeadlines() {
+    uint64_t now = monotonicMicros(), next = 0;
+    for (Job* job = jobList; job; job = job->next) {
+        uint64_t when = enforceDeadline(job, now);
+        if (when && (!next || when < next)) next = when;
+    }
+    return next;
+}
+
+// Sets up the epoll set a job with a deadline is waited for in
+int initSupervisor() {
+    if (superviseFd >= 0) return 0;
+    superviseFd = epoll_create1(EPOLL_CLOEXEC);
+    deadlineTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    struct epoll_event events[2] = {{EPOLLIN, {.fd = sigchldPipe[0]}}, {EPOLLIN, {.fd = deadlineTimerFd}}};
+    if (superviseFd < 0 || deadlineTimerFd < 0 ||
+        epoll_ctl(superviseFd, EPOLL_CTL_ADD, sigchldPipe[0], &events[0]) < 0 ||
+        epoll_ctl(superviseFd, EPOLL_CTL_ADD, deadlineTimerFd, &events[1]) < 0) {
+        perror("epoll");
+        if (superviseFd >= 0) close(superviseFd);
+        if (deadlineTimerFd >= 0) close(deadlineTimerFd);
+        superviseFd = deadlineTimerFd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Waits for a job until it exits or stops while deadlines are pending. Instead of blocking
+// in wait4, the shell sleeps in epoll until SIGCHLD or the deadline timer wakes it, so a
+// deadline is enforced even if no process ever exits.
+void superviseJob(Job* job) {
+    while (job->running > 0 && !job->stopped) {
+        char drain[64];
+        if (read(sigchldPipe[0], drain, sizeof(drain)) > 0) {
+            while (read(sigchldPipe[0], drain, sizeof(drain)) > 0) ;
+            childExited = 1; // Background jobs may have changed too; reapJobs looks later
+        }
+        int status, changed = 0;
+        struct rusage usage;
+        pid_t pid;
+        while ((pid = wait4(-job->pgid, &status, WNOHANG | WUNTRACED, &usage)) > 0) {
+            updateJobProcess(job, pid, status, &usage);
+            changed = 1;
+        }
+        if (pid < 0 && errno == ECHILD) {
+            job->running = 0; // The whole group is gone
+            break;
+        }
+        if (changed) continue;
+
+        uint64_t next = enforceDeadline(job, monotonicMicros());
+        uint64_t background = enforceJobDeadlines();
+        if (background && (!next || background < next)) next = background;
+        struct itimerspec when;
+        memset(&when, 0, sizeof(when));
+        when.it_value.tv_sec = next / 1000000;
+        when.it_value.tv_nsec = next % 1000000 * 1000;
+        timerfd_settime(deadlineTimerFd, TFD_TIMER_ABSTIME, &when, NULL); // 0 disarms
+        struct epoll_event events[2];
+        epoll_wait(superviseFd, events, 2, -1);
+        uint64_t expirations;
+        while (read(deadlineTimerFd, &expirations, sizeof(expirations)) > 0) ; // Rearmed next round
+    }
+}
+
+// Waits until a job exits or stops. A foreground job gets the terminal meanwhile and
+// moves to the job table if it stops. Returns the job's wait status.
+int waitForJob(Job* job, int foreground) {
+    if (foreground && jobControl && job->pgid) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    // With a deadline to keep, this job's or a background job's, wait in the event loop
+    if ((job->deadlineUs || enforceJobDeadlines()) && job->pgid && initSupervisor() == 0) {
+        superviseJob(job);
+    }
+    int i = 0;
+    while (job->running > 0 && !job->stopped) {
+        // Without a process group of its own, wait for the job's processes one by one
+        if (!job->pgid && (i >= job->pidCount || job->pids[i] <= 0)) {
+            if (i >= job->pidCount) break;
+            i++;
+            continue;
+        }
+        pid_t target = job->pgid ? -job->pgid : job->pids[i];
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(target, &status, WUNTRACED, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            if (job->pgid) {
+                job->running = 0; // ECHILD: the whole group is gone
+            } else {
+                job->running--;
+                i++;
+            }
+            continue;
+        }
+        updateJobProcess(job, pid, status, &usage);
+        if (!job->pgid && !WIFSTOPPED(status)) i++;
+    }
+    if (foreground && jobControl && job->pgid) {
+        tcsetpgrp(STDIN_FILENO, shellPgid);
+    }
+
+    if (job->stopped) {
+        if (job->id == 0) addJob(job);
+        printf("\n[%d]  Stopped    %s\n", job->id, job->command);
+        return (128 + SIGTSTP) << 8;
+    }
+    int status = jobStatus(job);
+    if (foreground && jobControl && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+        printf("\n"); // Keep the next prompt off the ^C line
+    }
+    if (job->id != 0) removeJob(job);
+    freeJob(job);
+    return status;
+}
+
+// Converts a wait status into the exit code a builtin reports
+int exitCodeFromStatus(int status) {
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+// Finds a job from '%n', 'n' or, without an argument, the most recent job
+Job* findJobSpec(int argc, char** argv, const char* builtin) {
+    Job* job = NULL;
+    if (argc < 2) {
+        for (Job* j = jobList; j; j = j->next) job = j;
+        return job;
+    }
+    const char* spec = argv[1][0] == '%' ? argv[1] + 1 : argv[1];
+    int id = atoi(spec);
+    for (Job* j = jobList; j; j = j->next) {
+        if (j->id == id) return j;
+    }
+    printf("%s: %s: no such job\n", builtin, argv[1]);
+    return NULL;
+}
+
+// Source of command lines: a file descriptor read through one growable buffer, or a
+// memory block (an mmap'd script or a -c string) copied line by line into a reused buffer
+typedef struct {
+    int fd;
+    char* buf;          // Read buffer for fd input; also holds lines copied out of memory input
+    size_t cap;
+    size_t start, end;  // Unconsumed bytes in buf
+    const char* mem;    // Memory input, NULL when reading from fd
+    size_t memLen, memPos;
+    size_t mapLen;      // Non-zero when mem is an mmap that must be unmapped
+    int eof;
+    int reapWhileWaiting; // Reap background jobs while blocked waiting for input
+} LineReader;
+
+int runShellLoop(LineReader* reader, int interactive, int status);
+
+void initLineReader(LineReader* reader, int fd, const char* mem, size_t memLen) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->mem = mem;
+    reader->memLen = memLen;
+    reader->cap = LINE_BUFFER_SIZE;
+    reader->buf = memAlloc(MEM_INPUT, reader->cap);
+}
+
+// Maps a script file so lines are found without read() calls; small or special files are read instead
+int openScriptReader(LineReader* reader, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            initLineReader(reader, -1, map, st.st_size);
+            reader->mapLen = st.st_size;
+            return 0;
+        }
+    }
+    initLineReader(reader, fd, NULL, 0);
+    return 0;
+}
+
+// Makes room for at least need bytes in the reader's buffer
+void growLineBuffer(LineReader* reader, size_t need) {
+    if (need <= reader->cap) return;
+    while (reader->cap < need) reader->cap *= 2;
+    reader->buf = memRealloc(MEM_INPUT, reader->buf, reader->cap);
+}
+
+// Blocks until fd is readable, reaping background jobs as they finish, enforcing their
+// deadlines and collecting the output of detached sessions meanwhile
+void waitForInput(int fd) {
+    struct pollfd fds[2 + MAX_POLLED_SESSIONS];
+    while (1) {
+        reapJobs();
+        uint64_t deadline = enforceJobDeadlines();
+        int timeoutMs = -1;
+        if (deadline) {
+            uint64_t now = monotonicMicros();
+            timeoutMs = deadline > now ? (int)((deadline - now + 999) / 1000) : 0;
+        }
+        fds[0] = (struct pollfd){fd, POLLIN, 0};
+        fds[1] = (struct pollfd){sigchldPipe[0], POLLIN, 0};
+        int sessions = sessionPollFds(fds + 2, MAX_POLLED_SESSIONS);
+        int n = poll(fds, 2 + sessions, timeoutMs);
+        if (n < 0 && errno != EINTR) return;
+        if (n <= 0) continue;
+        if (fds[1].revents) childExited = 1; // Let reapJobs drain the pipe
+        serviceSessions(fds + 2, sessions);
+        if (fds[0].revents) return;
+    }
+}
+
+// Returns the next line without its newline, or NULL at end of input.
+// The line lives in the reader's buffer until the next call; lines of any length are kept whole.
+char* readLine(LineReader* reader) {
+    if (reader->mem) {
+        if (reader->memPos >= reader->memLen) return NULL;
+        const char* line = reader->mem + reader->memPos;
+        size_t left = reader->memLen - reader->memPos;
+        const char* nl = memchr(line, '\n', left);
+        size_t len = nl ? (size_t)(nl - line) : left;
+        reader->memPos += len + (nl != NULL);
+        growLineBuffer(reader, len + 1);
+        memcpy(reader->buf, line, len);
+        reader->buf[len] = '\0';
+        return reader->buf;
+    }
+
+    size_t scanned = reader->start;
+    while (1) {
+        char* nl = memchr(reader->buf + scanned, '\n', reader->end - scanned);
+        if (nl) {
+            char* line = reader->buf + reader->start;
+            *nl = '\0';
+            reader->start = nl - reader->buf + 1;
+            return line;
+        }
+        if (reader->eof) {
+            if (reader->start == reader->end) return NULL;
+            // Last line without a trailing newline
+            growLineBuffer(reader, reader->end + 1);
+            char* line = reader->buf + reader->start;
+            reader->buf[reader->end] = '\0';
+            reader->start = reader->end;
+            return line;
+        }
+
+        // Move the partial line to the front, grow if it fills the buffer, then read more
+        if (reader->start > 0) {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        scanned = reader->end;
+        growLineBuffer(reader, reader->end + LINE_BUFFER_SIZE / 2);
+        if (reader->reapWhileWaiting) {
+            waitForInput(reader->fd);
+        }
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end - 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            reader->eof = 1;
+        } else if (n == 0) {
+            reader->eof = 1;
+        } else {
+            reader->end += n;
+        }
+    }
+}
+
+// Releases the reader's buffer, descriptor and mapping
+void closeLineReader(LineReader* reader) {
+    memFree(reader->buf);
+    reader->buf = NULL;
+    if (reader->fd > STDIN_FILENO) close(reader->fd);
+    if (reader->mapLen) munmap((void*)reader->mem, reader->mapLen);
+}
+
+// Creates the cgroup v2 leaf that enforces a 'run --mem/--cpu-max' limit, below
+// $SHELL24_CGROUP or else the shell's own cgroup, and writes the limits into it.
+// The leaf is removed with the job. Returns -1 after reporting why it failed.
+int createLimitCgroup(ProcessLimits* limits) {
+    static unsigned int serial = 0;
+    char parent[4200], path[4400], value[64];
+    const char* base = getenv("SHELL24_CGROUP");
+    if (base && *base) {
+        snprintf(parent, sizeof(parent), "%s", base);
+    } else {
+        // "0::/user.slice/..." is the cgroup v2 line of /proc/self/cgroup
+        char line[4096] = "";
+        FILE* fp = fopen("/proc/self/cgroup", "r");
+        while (fp && fgets(line, sizeof(line), fp) && strncmp(line, "0::", 3) != 0) line[0] = '\0';
+        if (fp) fclose(fp);
+        if (strncmp(line, "0::", 3) != 0) {
+            printf("run: no cgroup v2 hierarchy\n");
+            return -1;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        // A hybrid setup mounts the v2 hierarchy under unified/
+        const char* root = access(CGROUP_ROOT "/cgroup.controllers", F_OK) == 0 ? CGROUP_ROOT : CGROUP_ROOT "/unified";
+        snprintf(parent, sizeof(parent), "%s%s", root, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+    }
+
+    // Best effort: the controllers may already be enabled, or only be enabled by the owner
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", parent);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (limits->memoryMax) writeAll(fd, "+memory", 7);
+        if (limits->cpuQuotaUs) writeAll(fd, "+cpu", 4);
+        close(fd);
+    }
+
+    snprintf(path, sizeof(path), "%s/shell24-%d-%u", parent, (int)getpid(), serial++);
+    if (mkdir(path, 0755) < 0) {
+        fprintf(stderr, "run: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    limits->cgroup = memStrdup(MEM_JOBS, path);
+    struct { const char* file; int set; } settings[] = {
+        {"memory.max", limits->memoryMax > 0},
+        {"cpu.max", limits->cpuQuotaUs > 0},
+    };
+    for (int i = 0; i < 2; i++) {
+        if (!settings[i].set) continue;
+        if (i == 0) snprintf(value, sizeof(value), "%lld", limits->memoryMax);
+        else snprintf(value, sizeof(value), "%ld %d", limits->cpuQuotaUs, CGROUP_CPU_PERIOD_US);
+        snprintf(path, sizeof(path), "%s/%s", limits->cgroup, settings[i].file);
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0 || writeAll(fd, value, strlen(value)) < 0) {
+            fprintf(stderr, "run: %s: %s\n", path, strerror(errno));
+            if (fd >= 0) close(fd);
+            rmdir(limits->cgroup);
+            memFree(limits->cgroup);
+            limits->cgroup = NULL;
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+// Applies a 'run' prefix to the calling process, a forked pipeline stage about to exec.
+// With --pin, stage n gets the n-th CPU of the allowed set (wrapping around) to itself.
+void applyProcessLimits(ProcessLimits* limits, int stageIndex) {
+    if (limits->cgroup) {
+        char path[4400];
+        snprintf(path, sizeof(path), "%s/cgroup.procs", limits->cgroup);
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0 || writeAll(fd, "0", 1) < 0) {
+            perror("run: cgroup");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+
+    cpu_set_t cpus;
+    if (limits->hasCpus) {
+        cpus = limits->cpus;
+    } else {
+        sched_getaffinity(0, sizeof(cpus), &cpus);
+    }
+    if (limits->pin) {
+        int slot = stageIndex % CPU_COUNT(&cpus);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpus) && slot-- == 0) {
+                CPU_ZERO(&cpus);
+                CPU_SET(cpu, &cpus);
+                break;
+            }
+        }
+    }
+    if ((limits->hasCpus || limits->pin) && sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+        perror("run: sched_setaffinity");
+        exit(EXIT_FAILURE);
+    }
+
+    if (limits->policy >= 0) {
+        struct sched_param param = {0};
+        if (sched_setscheduler(0, limits->policy, &param) < 0) {
+            perror("run: sched_setscheduler");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (limits->hasNice && setpriority(PRIO_PROCESS, 0, limits->nice) < 0) {
+        perror("run: setpriority");
+        exit(EXIT_FAILURE);
+    }
+    if (limits->ioClass && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                                   limits->ioClass << IOPRIO_CLASS_SHIFT | limits->ioLevel) < 0) {
+        perror("run: ioprio_set");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Reports why a posix_spawn call failed, matching the messages of the fork path
+void reportSpawnFailure(Command* cmd, int err) {
+    // File actions run before exec, so open the redirection targets the way the fork path
+    // does first. The child's file actions already created a missing output target.
+    int fd;
+    if (cmd->fileIP) {
+        if ((fd = open(cmd->fileIP, O_RDONLY | O_CLOEXEC)) < 0) {
+            perror("Failed to open input file");
+            return;
+        }
+        close(fd);
+    }
+    if (cmd->fileOP) {
+        if ((fd = open(cmd->fileOP, O_WRONLY | O_CREAT | O_CLOEXEC, 0666)) < 0) {
+            perror("Failed to open output file");
+            return;
+        }
+        close(fd);
+    }
+    errno = err;
+    printf("%s", cmd->argv[0]);
+    fflush(stdout);
+    perror("Failed to execute command");
+}
+
+// Starts an external command with its redirections and returns its pid. inFd and outFd
+// (or -1) become the child's stdin/stdout, e.g. pipe ends; every other descriptor the shell
+// opens is close-on-exec, so the child gets only what it needs. pgid is the process group
+// to join: 0 starts a new one, -1 stays in the shell's. Uses posix_spawn with file actions
+// unless 'set launch fork' selected the fork path.
+pid_t spawnCommand(Command* cmd, int inFd, int outFd, pid_t pgid) {
+    char** argv = cmd->argv;
+
+    // Flush buffered output so the child does not inherit a half-written prompt
+    fflush(stdout);
+
+    // posix_spawn cannot place the child, so 'run' pipelines are forked
+    if (launchMode == LAUNCH_FORK || cmd->limits) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (pgid >= 0) setpgid(0, pgid);
+            resetChildSignals();
+            if (cmd->limits) applyProcessLimits(cmd->limits, cmd->stageIndex);
+            if (inFd >= 0) dup2(inFd, STDIN_FILENO);
+            if (outFd >= 0) dup2(outFd, STDOUT_FILENO);
+            applyRedirections(cmd->fileIP, cmd->fileOP, cmd->outputMode);
+            execResolvedCommand(argv);
+        } else if (pid < 0) {
+            perror("fork");
+        } else if (pgid >= 0) {
+            setpgid(pid, pgid ? pgid : pid); // Also from the parent, so there is no race
+        }
+        return pid;
+    }
+
+    // Negative entries fail here without touching the filesystem
+    const char* path = resolveCommandPath(argv[0]);
+    if (path == NULL) {
+        reportSpawnFailure(cmd, ENOENT);
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (inFd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+    }
+    if (outFd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+    }
+    if (cmd->fileIP) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, cmd->fileIP, O_RDONLY, 0);
+    }
+    if (cmd->fileOP) {
+        int cached = cmd->outputMode == OUTPUT_APPEND ? cachedRedirectionFd(cmd->fileOP, 0) : -1;
+        if (cached >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, cached, STDOUT_FILENO);
+        } else {
+            int flags = O_WRONLY | O_CREAT | (cmd->outputMode == OUTPUT_APPEND ? O_APPEND : O_TRUNC);
+            posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, cmd->fileOP, flags, 0666);
+        }
+    }
+
+    // Job-control signals the shell ignores go back to default; optionally set the group
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    if (pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    if (err == ENOENT && path != argv[0]) {
+        // The cached binary went away before the directory mtime was re-checked
+        forgetCommandPath(argv[0]);
+        path = resolveCommandPath(argv[0]);
+        err = path ? posix_spawn(&pid, path, &actions, &attr, argv, environ) : ENOENT;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        reportSpawnFailure(cmd, err);
+        return -1;
+    }
+    return pid;
+}
+
+// Prints the current value of every 'set' option
+void printShellOptions() {
+    printf("launch %s\n", launchMode == LAUNCH_FORK ? "fork" : "spawn");
+    printf("pipefail %s\n", pipefailEnabled ? "on" : "off");
+    printf("pipesize %d\n", pipeCapacity);
+    printf("ringsize %ld\n", ringSize);
+    printf("memosize %ld\n", memoLimit);
+    char duration[32];
+    if (commandDeadlineMs) formatDuration(commandDeadlineMs, duration, sizeof(duration));
+    printf("deadline %s\n", commandDeadlineMs ? duration : "off");
+    formatDuration(killGraceMs, duration, sizeof(duration));
+    printf("killgrace %s\n", duration);
+    printf("redircache %s\n", redirCacheEnabled ? "on" : "off");
+    printf("buffercap %ld\n", bufferCap);
+}
+
+// Handles 'set [option [value]]': launch spawn|fork, pipefail on|off, pipesize BYTES,
+// ringsize BYTES, memosize BYTES, deadline DURATION|off, killgrace DURATION,
+// buffercap BYTES, redircache on|off
+int setShellOption(int argc, char** argv) {
+    if (argc < 3) {
+        printShellOptions();
+        return 0;
+    }
+    if (strcmp(argv[1], "launch") == 0) {
+        if (strcmp(argv[2], "fork") == 0) {
+            launchMode = LAUNCH_FORK;
+        } else if (strcmp(argv[2], "spawn") == 0) {
+            launchMode = LAUNCH_SPAWN;
+        } else {
+            printf("set: launch must be 'spawn' or 'fork'\n");
+            return 1;
+        }
+        return 0;
+    }
+    if (strcmp(argv[1], "pipefail") == 0) {
+        if (strcmp(argv[2], "on") != 0 && strcmp(argv[2], "off") != 0) {
+            printf("set: pipefail must be 'on' or 'off'\n");
+            return 1;
+        }
+        pipefailEnabled = (strcmp(argv[2], "on") == 0);
+        return 0;
+    }
+    if (strcmp(argv[1], "pipesize") == 0) {
+        long long size = parseByteSize(argv[2]);
+        if (size < 0 || size > INT32_MAX) {
+            printf("set: pipesize must be a byte count (0 keeps the kernel default)\n");
+            return 1;
+        }
+        pipeCapacity = (int)size;
+        return 0;
+    }
+    if (strcmp(argv[1], "ringsize") == 0) {
+        long long size = parseByteSize(argv[2]);
+        if (size < 0 || size > (1LL << 30)) {
+            printf("set: ringsize must be a byte count up to 1G (0 always uses pipes)\n");
+            return 1;
+        }
+        ringSize = (long)size;
+        return 0;
+    }
+    if (strcmp(argv[1], "memosize") == 0) {
+        long long size = parseByteSize(argv[2]);
+        if (size < 0) {
+            printf("set: memosize must be a byte count\n");
+            return 1;
+        }
+        memoLimit = (long)size;
+        evictMemoFiles();
+        return 0;
+    }
+    if (strcmp(argv[1], "deadline") == 0) {
+        long ms = strcmp(argv[2], "off") == 0 ? 0 : parseDuration(argv[2]);
+        if (ms < 0) {
+            printf("set: deadline must be a duration such as 30s, 500ms or 5m, or 'off'\n");
+            return 1;
+        }
+        commandDeadlineMs = ms;
+        return 0;
+    }
+    if (strcmp(argv[1], "killgrace") == 0) {
+        long ms = parseDuration(argv[2]);
+        if (ms < 0) {
+            printf("set: killgrace must be a duration such as 2s\n");
+            return 1;
+        }
+        killGraceMs = ms;
+        return 0;
+    }
+    if (strcmp(argv[1], "buffercap") == 0) {
+        long long size = parseByteSize(argv[2]);
+        if (size < 0) {
+            printf("set: buffercap must be a byte count (0 for no limit)\n");
+            return 1;
+        }
+        bufferCap = (long)size;
+        return 0;
+    }
+    if (strcmp(argv[1], "redircache") == 0) {
+        if (strcmp(argv[2], "on") != 0 && strcmp(argv[2], "off") != 0) {
+            printf("set: redircache must be 'on' or 'off'\n");
+            return 1;
+        }
+        redirCacheEnabled = (strcmp(argv[2], "on") == 0);
+        if (!redirCacheEnabled) flushRedirCache();
+        return 0;
+    }
+    printf("set: unknown option '%s'\n", argv[1]);
+    return 1;
+}
+
+// Handles 'hash' (list), 'hash -r' (clear) and 'hash name...' (resolve ahead of time)
+int hashBuiltin(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        flushPathCache(-1);
+        pathCache.hits = pathCache.misses = 0;
+        return 0;
+    }
+    if (argc > 1) {
+        int status = 0;
+        for (int i = 1; i < argc; i++) {
+            if (resolveCommandPath(argv[i]) == NULL) {
+                printf("hash: %s: not found\n", argv[i]);
+                status = 1;
+            }
+        }
+        return status;
+    }
+
+    validatePathCache();
+    printf("hits\tcommand\n");
+    for (int b = 0; b < PATH_CACHE_BUCKETS; b++) {
+        for (PathCacheEntry* entry = pathCache.buckets[b]; entry; entry = entry->next) {
+            if (entry->path) {
+                printf("%4lu\t%s\n", entry->hits, entry->path);
+            } else {
+                printf("%4lu\t%s (not found)\n", entry->hits, entry->name);
+            }
+        }
+    }
+    printf("lookups: %lu hits, %lu misses\n", pathCache.hits, pathCache.misses);
+    return 0;
+}
+
+// Handles 'stats' (parse, spawn and run latency per command name, in microseconds),
+// 'stats name...' (only those commands) and 'stats -r' (clear)
+int statsBuiltin(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        for (int b = 0; b < PATH_CACHE_BUCKETS; b++) {
+            while (statsTable[b]) {
+                CommandStats* stats = statsTable[b];
+                statsTable[b] = stats->next;
+                memFree(stats->name);
+                memFree(stats);
+            }
+        }
+        return 0;
+    }
+
+    printf("%-16s %8s %15s %15s %27s\n", "command", "count", "parse p50/p99", "spawn p50/p99", "run p50/p90/p99/max");
+    for (int b = 0; b < PATH_CACHE_BUCKETS; b++) {
+        for (CommandStats* stats = statsTable[b]; stats; stats = stats->next) {
+            int listed = (argc < 2);
+            for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], stats->name) == 0) listed = 1;
+            }
+            if (!listed) continue;
+
+            char parse[40], spawn[40], run[80];
+            snprintf(parse, sizeof(parse), "%llu/%llu", (unsigned long long)histogramPercentile(&stats->parse, 50),
+                     (unsigned long long)histogramPercentile(&stats->parse, 99));
+            snprintf(spawn, sizeof(spawn), "%llu/%llu", (unsigned long long)histogramPercentile(&stats->spawn, 50),
+                     (unsigned long long)histogramPercentile(&stats->spawn, 99));
+            snprintf(run, sizeof(run), "%llu/%llu/%llu/%llu", (unsigned long long)histogramPercentile(&stats->run, 50),
+                     (unsigned long long)histogramPercentile(&stats->run, 90),
+                     (unsigned long long)histogramPercentile(&stats->run, 99), (unsigned long long)stats->run.max);
+            printf("%-16s %8llu %15s %15s %27s\n", stats->name, (unsigned long long)stats->run.count, parse, spawn, run);
+        }
+    }
+    return 0;
+}
+
+// Prints the backslash escape that starts at p (just after the '\'); returns how many
+// characters it used. '\c' sets *stop. Octal escapes are \0NNN for echo and %b, \NNN in
+// a printf format.
+int printEscape(const char* p, int zeroOctal, int* stop) {
+    switch (*p) {
+        case 'a': putchar('\a'); return 1;
+        case 'b': putchar('\b'); return 1;
+        case 'c': *stop = 1; return 1;
+        case 'e': putchar(27); return 1;
+        case 'f': putchar('\f'); return 1;
+        case 'n': putchar('\n'); return 1;
+        case 'r': putchar('\r'); return 1;
+        case 't': putchar('\t'); return 1;
+        case 'v': putchar('\v'); return 1;
+        case '\\': putchar('\\'); return 1;
+        case '\0': putchar('\\'); return 0;
+    }
+    if (*p >= '0' && *p <= '7') {
+        const char* q = (zeroOctal && *p == '0') ? p + 1 : p;
+        int value = 0;
+        for (int n = 0; n < 3 && *q >= '0' && *q <= '7'; n++) {
+            value = value * 8 + (*q++ - '0');
+        }
+        putchar(value);
+        return q - p;
+    }
+    putchar('\\');
+    putchar(*p);
+    return 1;
+}
+
+// Prints text with backslash escapes expanded; returns 1 if '\c' ended the output
+int printEscapedText(const char* text) {
+    int stop = 0;
+    for (const char* p = text; *p && !stop; p++) {
+        if (*p == '\\') {
+            p += printEscape(p + 1, 1, &stop);
+        } else {
+            putchar(*p);
+        }
+    }
+    return stop;
+}
+
+// Handles 'echo [-n] [-e|-E] [word...]' like GNU echo
+int echoBuiltin(int argc, char** argv) {
+    int newline = 1, escapes = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        // A word is only an option if every letter is n, e or E
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) break;
+        for (const char* p = argv[i] + 1; *p; p++) {
+            if (*p == 'n') newline = 0;
+            else escapes = (*p == 'e');
+        }
+    }
+    for (; i < argc; i++) {
+        if (escapes) {
+            if (printEscapedText(argv[i])) return 0;
+        } else {
+            fputs(argv[i], stdout);
+        }
+        if (i < argc - 1) putchar(' ');
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+// Converts a printf numeric argument; 'c or "c gives the character's code
+int printfNumber(const char* arg, int isSigned, long long* value) {
+    if (arg == NULL || *arg == '\0') {
+        *value = 0;
+        return 0;
+    }
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *value = (unsigned char)arg[1];
+        return 0;
+    }
+    char* end;
+    errno = 0;
+    *value = isSigned ? strtoll(arg, &end, 0) : (long long)strtoull(arg, &end, 0);
+    if (*end != '\0' || errno) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        return 1;
+    }
+    return 0;
+}
+
+// Handles 'printf FORMAT [argument...]' with the conversions d i o u x X f e g E G c s b
+// and %%, flags, width and precision. The format is reused until all arguments are used,
+// as in POSIX printf. Anything else (e.g. '*' widths) is left to the real printf.
+int printfBuiltin(int argc, char** argv) {
+    if (argc < 2) return BUILTIN_EXTERNAL;
+    const char* format = argv[1];
+    for (const char* p = format; *p; p++) {
+        if (*p != '%') continue;
+        p++;
+        p += strspn(p, "-+ #0123456789.");
+        if (*p == '\0' || strchr("diouxXfeEgGcsb%", *p) == NULL) return BUILTIN_EXTERNAL;
+    }
+
+    int argi = 2, status = 0, stop = 0;
+    do {
+        int conversions = 0;
+        for (const char* p = format; *p && !stop; p++) {
+            if (*p == '\\') {
+                p += printEscape(p + 1, 0, &stop);
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            // Rebuild the conversion for the C printf with a long long or double argument
+            char spec[48];
+            size_t flagLen = strspn(p + 1, "-+ #0123456789.");
+            if (flagLen > 32) flagLen = 32;
+            memcpy(spec, p, flagLen + 1);
+            p += flagLen + 1;
+            char conversion = *p;
+            const char* arg = argi < argc ? argv[argi++] : NULL;
+            conversions++;
+            long long number;
+            switch (conversion) {
+                case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+                    status |= printfNumber(arg, conversion == 'd' || conversion == 'i', &number);
+                    sprintf(spec + flagLen + 1, "ll%c", conversion);
+                    printf(spec, number);
+                    break;
+                case 'f': case 'e': case 'E': case 'g': case 'G':
+                    sprintf(spec + flagLen + 1, "%c", conversion);
+                    printf(spec, arg ? strtod(arg, NULL) : 0.0);
+                    break;
+                case 'c':
+                    strcpy(spec + flagLen + 1, "c");
+                    if (arg && *arg) printf(spec, arg[0]);
+                    break;
+                case 's':
+                    strcpy(spec + flagLen + 1, "s");
+                    printf(spec, arg ? arg : "");
+                    break;
+                case 'b':
+                    if (arg) stop = printEscapedText(arg);
+                    break;
+            }
+        }
+        if (conversions == 0) break; // Extra arguments are ignored without conversions
+    } while (argi < argc && !stop);
+    return status;
+}
+
+int trueBuiltin(int argc, char** argv) {
+    return 0;
+}
+
+int falseBuiltin(int argc, char** argv) {
+    return 1;
+}
+
+// Converts a test integer operand; returns -1 after reporting a bad one
+int testInteger(const char* text, long long* value) {
+    char* end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || errno) {
+        fprintf(stderr, "test: %s: integer expression expected\n", text);
+        return -1;
+    }
+    return 0;
+}
+
+// Evaluates 'test -X operand'; returns 0 (true), 1 (false) or 2 (unknown operator)
+int testUnary(const char* op, const char* operand) {
+    struct stat st;
+    if (strcmp(op, "-n") == 0) return operand[0] == '\0';
+    if (strcmp(op, "-z") == 0) return operand[0] != '\0';
+    if (strcmp(op, "-t") == 0) return !isatty(atoi(operand));
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0' || strchr("bcdefghkLprsSuwx", op[1]) == NULL) {
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+    if (op[1] == 'r' || op[1] == 'w' || op[1] == 'x') {
+        return access(operand, op[1] == 'r' ? R_OK : op[1] == 'w' ? W_OK : X_OK) != 0;
+    }
+    int found = (op[1] == 'h' || op[1] == 'L') ? lstat(operand, &st) == 0 : stat(operand, &st) == 0;
+    if (!found) return 1;
+    switch (op[1]) {
+        case 'b': return !S_ISBLK(st.st_mode);
+        case 'c': return !S_ISCHR(st.st_mode);
+        case 'd': return !S_ISDIR(st.st_mode);
+        case 'f': return !S_ISREG(st.st_mode);
+        case 'g': return !(st.st_mode & S_ISGID);
+        case 'h': case 'L': return !S_ISLNK(st.st_mode);
+        case 'k': return !(st.st_mode & S_ISVTX);
+        case 'p': return !S_ISFIFO(st.st_mode);
+        case 's': return st.st_size == 0;
+        case 'S': return !S_ISSOCK(st.st_mode);
+        case 'u': return !(st.st_mode & S_ISUID);
+    }
+    return 0; // -e
+}
+
+// Evaluates 'test left OP right'; returns 0 (true), 1 (false) or 2 (error)
+int testBinary(const char* left, const char* op, const char* right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) != 0;
+    if (strcmp(op, "!=") == 0) return strcmp(left, right) == 0;
+    if (strcmp(op, "<") == 0) return strcmp(left, right) >= 0;
+    if (strcmp(op, ">") == 0) return strcmp(left, right) <= 0;
+    if (strcmp(op, "-a") == 0) return !(left[0] && right[0]);
+    if (strcmp(op, "-o") == 0) return !(left[0] || right[0]);
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat a, b;
+        int haveA = stat(left, &a) == 0, haveB = stat(right, &b) == 0;
+        if (op[1] == 'e') return !(haveA && haveB && a.st_dev == b.st_dev && a.st_ino == b.st_ino);
+        if (op[1] == 'o') {
+            struct stat tmp = a;
+            a = b;
+            b = tmp;
+            int have = haveA;
+            haveA = haveB;
+            haveB = have;
+        }
+        if (!haveA) return 1;
+        if (!haveB) return 0;
+        return !(a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+                 (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec));
+    }
+
+    const char* intOps[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (int i = 0; i < 6; i++) {
+        if (strcmp(op, intOps[i]) != 0) continue;
+        long long a, b;
+        if (testInteger(left, &a) < 0 || testInteger(right, &b) < 0) return 2;
+        int result[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+        return !result[i];
+    }
+    fprintf(stderr, "test: %s: binary operator expected\n", op);
+    return 2;
+}
+
+// Evaluates a test expression by its number of words, as POSIX specifies
+int evaluateTest(int count, char** words) {
+    if (count == 0) return 1;
+    if (count == 1) return words[0][0] == '\0';
+    if (strcmp(words[0], "!") == 0 && count <= 4) {
+        int result = evaluateTest(count - 1, words + 1);
+        return result == 2 ? 2 : !result;
+    }
+    if (count == 2) return testUnary(words[0], words[1]);
+    if (count == 3) {
+        if (strcmp(words[0], "(") == 0 && strcmp(words[2], ")") == 0) return evaluateTest(1, words + 1);
+        return testBinary(words[0], words[1], words[2]);
+    }
+    if (count == 4 && strcmp(words[0], "(") == 0 && strcmp(words[3], ")") == 0) {
+        return evaluateTest(2, words + 1);
+    }
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
+}
+
+// Handles 'test EXPRESSION' and '[ EXPRESSION ]'
+int testBuiltin(int argc, char** argv) {
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    return evaluateTest(argc - 1, argv + 1);
+}
+
+// Ring transport between two shell-internal pipeline stages ('#' concatenation and the
+// 'cat' builtin): a single-producer/single-consumer ring in a shared mapping both forked
+// stages inherit. File data is read straight into the ring and written straight out of
+// it, so it is copied once less than through a pipe. The sides only make a system call
+// when one of them has to sleep: an eventfd per direction wakes the sleeper, and a pipe
+// whose ends each side holds tells it when the other side is gone, as a pipe would.
+typedef struct {
+    _Alignas(64) uint64_t head; // Bytes written so far; only the writer stores it
+    uint32_t writerWaiting;     // Writer sleeps until space is freed
+    _Alignas(64) uint64_t tail; // Bytes read so far; only the reader stores it
+    uint32_t readerWaiting;     // Reader sleeps until data is written
+    _Alignas(64) char data[];
+} RingShared;
+
+typedef struct RingBuffer {
+    RingShared* shared;
+    size_t capacity;            // Power of two
+    size_t mapSize;
+    uint64_t unsignaled;        // Writer: bytes written since the reader was last woken
+    int dataFd, spaceFd;        // eventfds: data was written, space was freed
+    int aliveRead, aliveWrite;  // Pipe held open by the reader and the writer respectively
+} RingBuffer;
+
+RingBuffer* stdinRing = NULL;   // Set in a stage that reads its input from a ring
+RingBuffer* stdoutRing = NULL;  // Set in a stage that writes its output to a ring
+
+// Creates a ring of at least size bytes; NULL if that fails, so the caller uses a pipe
+RingBuffer* createRing(Arena* arena, size_t size) {
+    size_t capacity = 4096;
+    while (capacity < size) capacity <<= 1;
+    RingBuffer* ring = arenaAlloc(arena, sizeof(RingBuffer));
+    memset(ring, 0, sizeof(*ring));
+    ring->capacity = capacity;
+    ring->mapSize = sizeof(RingShared) + capacity;
+    ring->shared = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring->shared == MAP_FAILED) return NULL;
+    int alive[2];
+    ring->dataFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring->spaceFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->dataFd < 0 || ring->spaceFd < 0 || pipe2(alive, O_CLOEXEC) < 0) {
+        if (ring->dataFd >= 0) close(ring->dataFd);
+        if (ring->spaceFd >= 0) close(ring->spaceFd);
+        munmap(ring->shared, ring->mapSize);
+        return NULL;
+    }
+    ring->aliveRead = alive[0];
+    ring->aliveWrite = alive[1];
+    return ring;
+}
+
+// Drops this process's hold on the ring; the shell calls it once both sides run
+void closeRing(RingBuffer* ring) {
+    if (ring->aliveRead >= 0) close(ring->aliveRead);
+    if (ring->aliveWrite >= 0) close(ring->aliveWrite);
+    close(ring->dataFd);
+    close(ring->spaceFd);
+    munmap(ring->shared, ring->mapSize);
+}
+
+// Sleeps until the other side made progress (ready() turns true) or went away (-1). The
+// waiting flag is set before ready() is checked again, so a wakeup cannot be missed.
+int waitOnRing(RingBuffer* ring, int writer) {
+    RingShared* shared = ring->shared;
+    uint32_t* waiting = writer ? &shared->writerWaiting : &shared->readerWaiting;
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    uint64_t head = __atomic_load_n(&shared->head, __ATOMIC_SEQ_CST);
+    uint64_t tail = __atomic_load_n(&shared->tail, __ATOMIC_SEQ_CST);
+    int gone = 0;
+    if (writer ? head - tail == ring->capacity : head == tail) {
+        // A closed pipe end is reported as POLLERR/POLLHUP even with no events requested
+        struct pollfd fds[2] = {{writer ? ring->spaceFd : ring->dataFd, POLLIN, 0},
+                                {writer ? ring->aliveWrite : ring->aliveRead, 0, 0}};
+        while (poll(fds, 2, -1) < 0 && errno == EINTR) ;
+        uint64_t count;
+        if (fds[0].revents && read(fds[0].fd, &count, sizeof(count)) < 0) count = 0;
+        gone = (fds[1].revents & (POLLERR | POLLHUP)) != 0;
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return gone ? -1 : 0;
+}
+
+void wakeRingSide(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0) {
+        // The counter is already nonzero: the side is woken anyway
+    }
+}
+
+// Writer: publishes len bytes written at the free span. The reader is woken once a
+// quarter of the ring is waiting for it, or on flush (the writer's input went quiet).
+void commitRingWrite(RingBuffer* ring, size_t len, int flush) {
+    RingShared* shared = ring->shared;
+    __atomic_store_n(&shared->head, shared->head + len, __ATOMIC_RELEASE);
+    ring->unsignaled += len;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ((flush || ring->unsignaled >= ring->capacity / 4) && __atomic_load_n(&shared->readerWaiting, __ATOMIC_RELAXED)) {
+        wakeRingSide(ring->dataFd);
+        ring->unsignaled = 0;
+    }
+}
+
+// Writer: waits for free space and returns the contiguous part of it
+char* ringWriteSpan(RingBuffer* ring, size_t* len) {
+    RingShared* shared = ring->shared;
+    uint64_t head = shared->head, tail;
+    while ((tail = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE)) + ring->capacity == head) {
+        commitRingWrite(ring, 0, 1); // Everything written so far has to go before sleeping
+        if (waitOnRing(ring, 1) < 0) {
+            raise(SIGPIPE); // The reader is gone, as with a pipe
+            errno = EPIPE;
+            return NULL;
+        }
+    }
+    size_t offset = head & (ring->capacity - 1);
+    size_t contiguous = ring->capacity - offset;
+    size_t space = ring->capacity - (head - tail);
+    *len = space < contiguous ? space : contiguous;
+    return shared->data + offset;
+}
+
+// Reader: waits for data and returns the contiguous part of it; NULL at the end of input
+char* ringReadSpan(RingBuffer* ring, size_t* len) {
+    RingShared* shared = ring->shared;
+    uint64_t tail = shared->tail, head;
+    while ((head = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE)) == tail) {
+        if (waitOnRing(ring, 0) < 0) {
+            // The writer exited; whatever it published before that is still read
+            if (__atomic_load_n(&shared->head, __ATOMIC_ACQUIRE) == tail) return NULL;
+        }
+    }
+    size_t offset = tail & (ring->capacity - 1);
+    size_t contiguous = ring->capacity - offset;
+    *len = head - tail < contiguous ? head - tail : contiguous;
+    return shared->data + offset;
+}
+
+// Reader: frees len bytes; a sleeping writer is woken once a quarter of the ring is free
+void commitRingRead(RingBuffer* ring, size_t len) {
+    RingShared* shared = ring->shared;
+    uint64_t tail = shared->tail + len;
+    __atomic_store_n(&shared->tail, tail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shared->writerWaiting, __ATOMIC_RELAXED) &&
+        (ring->capacity - (shared->head - tail) >= ring->capacity / 4 || shared->head == tail)) {
+        wakeRingSide(ring->spaceFd);
+    }
+}
+
+// Copies fd to the end of the input into the ring, reading straight into its free space
+int fillRingFromFd(RingBuffer* ring, int fd) {
+    while (1) {
+        size_t len;
+        char* span = ringWriteSpan(ring, &len);
+        if (span == NULL) return -1;
+        ssize_t n = read(fd, span, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            commitRingWrite(ring, 0, 1);
+            return n < 0 ? -1 : 0;
+        }
+        commitRingWrite(ring, n, (size_t)n < len); // A short read: the input has no more for now
+    }
+}
+
+// Copies the ring's data to the end of input into fd, or into another ring
+int drainRing(RingBuffer* ring, int fd, RingBuffer* out) {
+    size_t len;
+    char* span;
+    while (1) {
+        // Pass on what is buffered before sleeping on the input
+        if (out && __atomic_load_n(&ring->shared->head, __ATOMIC_ACQUIRE) == ring->shared->tail) {
+            commitRingWrite(out, 0, 1);
+        }
+        if ((span = ringReadSpan(ring, &len)) == NULL) break;
+        if (out) {
+            size_t room;
+            char* to = ringWriteSpan(out, &room);
+            if (to == NULL) return -1;
+            if (room < len) len = room;
+            memcpy(to, span, len);
+            commitRingWrite(out, len, 0);
+        } else if (writeAll(fd, span, len) < 0) {
+            return -1;
+        }
+        commitRingRead(ring, len);
+    }
+    if (out) commitRingWrite(out, 0, 1);
+    return 0;
+}
+
+// Whether a stage can write into a ring: '#' or 'cat' with files, without redirections.
+// Every other stage gets a pipe, and so does any boundary with an external process.
+int canWriteRing(Command* cmd) {
+    if (cmd->fileOP || cmd->teeCount || cmd->limits || cmd->argc == 0) return 0;
+    if (cmd->isConcat) return 1;
+    if (strcmp(cmd->argv[0], "cat") != 0) return 0;
+    for (int i = 1; i < cmd->argc; i++) {
+        if (cmd->argv[i][0] == '-' && cmd->argv[i][1]) return 0; // Options: the real cat
+    }
+    return 1;
+}
+
+// Whether a stage can read its input from a ring: 'cat' copying stdin
+int canReadRing(Command* cmd) {
+    if (cmd->fileIP || cmd->isConcat || !canWriteRing(cmd)) return 0;
+    if (cmd->argc == 1) return 1;
+    for (int i = 1; i < cmd->argc; i++) {
+        if (strcmp(cmd->argv[i], "-") == 0) return 1;
+    }
+    return 0;
+}
+
+// Handles 'cat [FILE...]' without options; '-' or no file copies stdin. Files are copied
+// like '#' concatenation. Options and a terminal on stdin are left to the real cat.
+int catBuiltin(int argc, char** argv) {
+    int readsStdin = (argc < 2);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-") == 0) readsStdin = 1;
+        else if (argv[i][0] == '-') return BUILTIN_EXTERNAL;
+    }
+    if (readsStdin && !stdinRing && !stdoutRing && isatty(STDIN_FILENO)) return BUILTIN_EXTERNAL;
+
+    struct stat outStat;
+    fflush(stdout);
+    if (fstat(STDOUT_FILENO, &outStat) < 0) {
+        outStat.st_mode = 0;
+    }
+    char* stdinOnly[] = {argv[0], "-"};
+    if (argc < 2) {
+        argc = 2;
+        argv = stdinOnly;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        int fromStdin = (strcmp(argv[i], "-") == 0);
+        if (fromStdin && stdinRing) {
+            if (drainRing(stdinRing, STDOUT_FILENO, stdoutRing) < 0) {
+                fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+                status = 1;
+            }
+            continue;
+        }
+        int fd = fromStdin ? STDIN_FILENO : open(argv[i], O_RDONLY);
+        if (fd < 0 || copyToStdout(fd, outStat.st_mode) < 0) {
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+        }
+        if (!fromStdin && fd >= 0) close(fd);
+    }
+    return status;
+}
+
+void startPipeline(Command* stages, int stageCount, Job* job, int outFd);
+
+// Stored before the key and the output in every 'memo' cache file
+typedef struct {
+    char magic[4];      // "S24M"
+    uint32_t keyLen;
+    int32_t status;     // Exit code of the command
+    uint32_t reserved;
+} MemoHeader;
+
+// A cache file found while scanning the 'memo' directory
+typedef struct {
+    char name[32];
+    off_t size;
+    struct timespec used;   // mtime, refreshed on every hit
+} MemoFile;
+
+struct {
+    unsigned long hits, misses, stores, evictions, uncacheable;
+} memoStats;
+
+struct stat shellStdin; // The shell's own stdin, see buildMemoKey
+
+// Growable buffer the cache key is built in
+typedef struct {
+    char* data;
+    size_t len, cap;
+} KeyBuffer;
+
+void appendKey(KeyBuffer* key, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int need = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (key->len + need + 1 > key->cap) {
+        key->cap = (key->len + need + 1) * 2;
+        key->data = memRealloc(MEM_MEMO, key->data, key->cap);
+    }
+    va_start(args, format);
+    vsnprintf(key->data + key->len, need + 1, format, args);
+    va_end(args);
+    key->len += need;
+}
+
+// Adds what identifies a file's contents: device, inode, size and mtime
+void appendKeyStat(KeyBuffer* key, const char* label, struct stat* st) {
+    appendKey(key, "%s=%lu:%lu:%lld:%ld.%09ld\n", label, (unsigned long)st->st_dev, (unsigned long)st->st_ino,
+              (long long)st->st_size, (long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+}
+
+// Builds the cache key of a command: argv, cwd, the environment that changes how programs
+// behave, the binary, and the identity of stdin, of the cwd and of every argument that
+// names a file.
+// Returns 0 when the command cannot be cached because stdin is a pipe or a socket fed by
+// an earlier pipeline stage; *detachStdin is set when stdin is the shell's own pipe, which
+// the command then does not get to read.
+int buildMemoKey(KeyBuffer* key, int argc, char** argv, int* detachStdin) {
+    struct stat st;
+    *detachStdin = 0;
+    if (fstat(STDIN_FILENO, &st) == 0) {
+        if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) {
+            if (st.st_dev != shellStdin.st_dev || st.st_ino != shellStdin.st_ino) return 0;
+            *detachStdin = 1;
+            st.st_mode = 0;
+        }
+        if (S_ISREG(st.st_mode)) {
+            appendKeyStat(key, "stdin", &st);
+            appendKey(key, "stdin-offset=%lld\n", (long long)lseek(STDIN_FILENO, 0, SEEK_CUR));
+        } else if (!*detachStdin) {
+            appendKey(key, "stdin=device %lu\n", (unsigned long)st.st_rdev); // A terminal's mtime changes all the time
+        }
+    }
+    char cwd[4096];
+    appendKey(key, "cwd=%s\n", getcwd(cwd, sizeof(cwd)) ? cwd : "?");
+    if (stat(".", &st) == 0) appendKeyStat(key, "cwd", &st); // 'ls' and friends read it without naming it
+    for (int i = 0; i < argc; i++) {
+        appendKey(key, "arg=%s\n", argv[i]);
+        if (i > 0 && stat(argv[i], &st) == 0) appendKeyStat(key, "file", &st);
+    }
+    const char* path = resolveCommandPath(argv[0]);
+    if (path && stat(path, &st) == 0) appendKeyStat(key, path, &st);
+    for (char** env = environ; *env; env++) {
+        if (strncmp(*env, "PATH=", 5) == 0 || strncmp(*env, "HOME=", 5) == 0 || strncmp(*env, "LANG=", 5) == 0 ||
+            strncmp(*env, "TZ=", 3) == 0 || strncmp(*env, "LC_", 3) == 0) {
+            appendKey(key, "env=%s\n", *env);
+        }
+    }
+    return 1;
+}
+
+// Directory of the cache: $SHELL24_MEMO_DIR, else $XDG_CACHE_HOME/shell24/memo, else
+// ~/.cache/shell24/memo. Created when create is set.
+const char* memoDirectory(int create) {
+    static char dir[4096];
+    if (dir[0] == '\0') {
+        const char* custom = getenv("SHELL24_MEMO_DIR");
+        const char* cache = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        if (custom && *custom) {
+            snprintf(dir, sizeof(dir), "%s", custom);
+        } else if (cache && *cache) {
+            snprintf(dir, sizeof(dir), "%s/shell24/memo", cache);
+        } else {
+            snprintf(dir, sizeof(dir), "%s/.cache/shell24/memo", home ? home : "/tmp");
+        }
+    }
+    if (create) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s", dir);
+        for (char* p = path + 1; *p; p++) {
+            if (*p != '/') continue;
+            *p = '\0';
+            mkdir(path, 0700);
+            *p = '/';
+        }
+        mkdir(path, 0700);
+    }
+    return dir;
+}
+
+// Lists the cache files (names are 16 hex digits) and returns their total size
+off_t scanMemoFiles(MemoFile** files, int* count) {
+    *files = NULL;
+    *count = 0;
+    DIR* dir = opendir(memoDirectory(0));
+    if (dir == NULL) return 0;
+    int dirFd = dirfd(dir);
+    off_t total = 0;
+    int cap = 0;
+    struct dirent* entry;
+    struct stat st;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strlen(entry->d_name) != 16 || fstatat(dirFd, entry->d_name, &st, 0) < 0) continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 64;
+            *files = memRealloc(MEM_MEMO, *files, cap * sizeof(MemoFile));
+        }
+        MemoFile* file = &(*files)[(*count)++];
+        snprintf(file->name, sizeof(file->name), "%s", entry->d_name);
+        file->size = st.st_size;
+        file->used = st.st_mtim;
+        total += st.st_size;
+    }
+    closedir(dir);
+    return total;
+}
+
+int compareMemoFiles(const void* a, const void* b) {
+    const struct timespec* x = &((const MemoFile*)a)->used;
+    const struct timespec* y = &((const MemoFile*)b)->used;
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// Deletes least recently used entries until the cache fits in 'set memosize'
+void evictMemoFiles() {
+    MemoFile* files;
+    int count;
+    off_t total = scanMemoFiles(&files, &count);
+    if (total > memoLimit) {
+        qsort(files, count, sizeof(MemoFile), compareMemoFiles);
+        char path[4200];
+        for (int i = 0; i < count && total > memoLimit; i++) {
+            snprintf(path, sizeof(path), "%s/%s", memoDirectory(0), files[i].name);
+            if (unlink(path) == 0) {
+                total -= files[i].size;
+                memoStats.evictions++;
+            }
+        }
+    }
+    memFree(files);
+}
+
+// Prints a cached result if the file holds exactly this key. Returns the exit code, or -1
+// when the entry is missing or belongs to another key (a hash collision).
+int replayMemoEntry(const char* path, KeyBuffer* key) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    MemoHeader header;
+    int match = pread(fd, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, "S24M", 4) == 0 &&
+                header.keyLen == key->len;
+    if (match) {
+        char* stored = memAlloc(MEM_MEMO, key->len);
+        match = pread(fd, stored, key->len, sizeof(header)) == (ssize_t)key->len && memcmp(stored, key->data, key->len) == 0;
+        memFree(stored);
+    }
+    if (!match) {
+        close(fd);
+        return -1;
+    }
+
+    futimens(fd, NULL); // Recently used: evicted last
+    lseek(fd, sizeof(header) + key->len, SEEK_SET);
+    struct stat outStat;
+    fflush(stdout);
+    if (fstat(STDOUT_FILENO, &outStat) < 0) outStat.st_mode = 0;
+    copyToStdout(fd, outStat.st_mode);
+    close(fd);
+    return header.status;
+}
+
+// Runs the command with stdout passing through a pipe, so it is printed as it comes and,
+// if it exits normally and the output fits the cache, stored under the key
+int runAndStoreMemo(int argc, char** argv, int detachStdin, KeyBuffer* key, const char* path) {
+    char tempPath[4300];
+    int store = -1;
+    if (key) {
+        memoDirectory(1);
+        snprintf(tempPath, sizeof(tempPath), "%s.tmp.%d", path, (int)getpid());
+        store = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    MemoHeader header = {{'S', '2', '4', 'M'}, key ? (uint32_t)key->len : 0, 0, 0};
+    if (store >= 0 && (writeAll(store, (char*)&header, sizeof(header)) < 0 || writeAll(store, key->data, key->len) < 0)) {
+        close(store);
+        unlink(tempPath);
+        store = -1;
+    }
+
+    int pd[2];
+    if (pipe2(pd, O_CLOEXEC) < 0) {
+        perror("pipe");
+        if (store >= 0) {
+            close(store);
+            unlink(tempPath);
+        }
+        return 1;
+    }
+    Command inner;
+    memset(&inner, 0, sizeof(inner));
+    inner.argv = argv;
+    inner.argc = argc;
+    inner.outputMode = OUTPUT_TRUNC;
+    inner.fileIP = detachStdin ? "/dev/null" : NULL;
+    Job* job = createJob(1, 0);
+    job->command = describeCommands(&inner, 1);
+    startPipeline(&inner, 1, job, pd[1]);
+    close(pd[1]);
+    int started = job->running > 0; // A command that could not be started is not cached
+
+    fflush(stdout);
+    char buf[65536];
+    off_t stored = 0;
+    ssize_t n;
+    while ((n = read(pd[0], buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        writeAll(STDOUT_FILENO, buf, n);
+        if (store >= 0 && (stored + n > memoLimit || writeAll(store, buf, n) < 0)) {
+            close(store); // Too large for the cache; keep printing
+            unlink(tempPath);
+            store = -1;
+        }
+        stored += n;
+    }
+    close(pd[0]);
+
+    int status = waitForJob(job, 1);
+    if (store >= 0) {
+        header.status = WEXITSTATUS(status);
+        int complete = started && WIFEXITED(status) && pwrite(store, &header, sizeof(header), 0) == sizeof(header);
+        close(store);
+        if (complete && rename(tempPath, path) == 0) {
+            memoStats.stores++;
+            evictMemoFiles();
+        } else {
+            unlink(tempPath);
+        }
+    }
+    return exitCodeFromStatus(status);
+}
+
+// Handles 'memo COMMAND [arg...]': replays the stored stdout and exit status of an identical
+// earlier run, or runs the command and stores them. 'memo --stats' and 'memo --clear'
+// report on and empty the cache.
+int memoBuiltin(int argc, char** argv) {
+    if (argc < 2) {
+        printf("memo: usage: memo COMMAND [arg...] | --stats | --clear\n");
+        return 2;
+    }
+    if (strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--clear") == 0) {
+        MemoFile* files;
+        int count;
+        off_t total = scanMemoFiles(&files, &count);
+        if (argv[1][2] == 'c') {
+            char path[4200];
+            for (int i = 0; i < count; i++) {
+                snprintf(path, sizeof(path), "%s/%s", memoDirectory(0), files[i].name);
+                unlink(path);
+            }
+        } else {
+            printf("directory   %s\n", memoDirectory(0));
+            printf("entries     %d\n", count);
+            printf("bytes       %lld of %ld\n", (long long)total, memoLimit);
+            printf("hits        %lu\n", memoStats.hits);
+            printf("misses      %lu\n", memoStats.misses);
+            printf("stores      %lu\n", memoStats.stores);
+            printf("evictions   %lu\n", memoStats.evictions);
+            printf("uncacheable %lu\n", memoStats.uncacheable);
+        }
+        memFree(files);
+        return 0;
+    }
+    if (argc - 1 > MAX_ARGS) {
+        printf("ERROR: Each command must have 1 to 5 arguments.\nPlease try again.\n");
+        return 1;
+    }
+
+    KeyBuffer key = {NULL, 0, 0};
+    int detachStdin;
+    if (!buildMemoKey(&key, argc - 1, argv + 1, &detachStdin)) {
+        memoStats.uncacheable++;
+        memFree(key.data);
+        return runAndStoreMemo(argc - 1, argv + 1, 0, NULL, NULL);
+    }
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a, 64 bit
+    for (size_t i = 0; i < key.len; i++) {
+        hash = (hash ^ (unsigned char)key.data[i]) * 1099511628211ULL;
+    }
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/%016llx", memoDirectory(0), (unsigned long long)hash);
+
+    int status = replayMemoEntry(path, &key);
+    if (status >= 0) {
+        memoStats.hits++;
+    } else {
+        memoStats.misses++;
+        status = runAndStoreMemo(argc - 1, argv + 1, detachStdin, &key, path);
+    }
+    memFree(key.data);
+    return status;
+}
+
+// Command history. The file is shared by every interactive shell24 (sessions opened with
+// 'newt' included) and is only ever appended to: a header holding the end offset, then
+// 8-byte aligned records. A shell reserves room for a line by atomically advancing the end
+// offset in the shared mapping and copies the line in, so recording costs no system call
+// unless the file has to grow. Each shell indexes the records in memory the first time it
+// looks something up, and catches up with lines other shells added since.
+#define HISTORY_MAGIC 0x48343253        // "S24H"
+#define HISTORY_RECORD_MAGIC 0xfe48fe48 // 0xfe never occurs in UTF-8 text
+#define HISTORY_PENDING 0x80000000      // Record reserved, text still being copied
+#define HISTORY_HEADER_SIZE 64
+#define HISTORY_MIN_SIZE (1 << 20)
+#define HISTORY_MAX_LINE (1 << 20)      // Longer lines are not recorded
+#define HISTORY_STUCK_US 2000000        // A record unfinished for this long was abandoned
+#define HISTORY_PAIR_SHARE 16           // A byte pair in more than 1/16 of the entries is not listed
+#define HISTORY_PAIR_MIN 256            // ...unless its list is this short
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t end;       // Offset where the next record goes; advanced atomically
+} HistoryHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;    // Text length; 0 while unwritten, HISTORY_PENDING while being copied
+} HistoryRecord;
+
+typedef struct {
+    uint32_t* entries;  // Ascending entry numbers
+    uint32_t count, capacity;
+    int common;         // Too common to narrow a search; no longer listed
+} HistoryBucket;
+
+struct {
+    int fd;             // -1 before the file is opened
+    int failed;
+    char* map;
+    size_t mapSize;
+    uint64_t indexedEnd;    // Records before this offset are indexed
+    uint64_t* offsets;      // Entry n (from 0) -> record offset
+    HistoryBucket* buckets;    // First two bytes -> entries, for prefix search
+    HistoryBucket* pairs;      // Byte pair -> entries containing it, for substring search
+    uint32_t count, capacity;
+    uint64_t stuckOffset, stuckSinceUs;
+    char* expanded;         // Buffer for lines produced by '!' expansion
+    size_t expandedCap;
+} history = {-1};
+
+// $SHELL24_HISTFILE, else ~/.shell24_history; NULL when history is disabled
+const char* historyPath() {
+    static char path[4096];
+    char* file = getenv("SHELL24_HISTFILE");
+    if (file) return *file ? file : NULL;
+    char* home = getenv("HOME");
+    if (!home) return NULL;
+    snprintf(path, sizeof(path), "%s/.shell24_history", home);
+    return path;
+}
+
+int mapHistory(size_t size) {
+    void* map = history.map
+        ? mremap(history.map, history.mapSize, size, MREMAP_MAYMOVE)
+        : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, history.fd, 0);
+    if (map == MAP_FAILED) {
+        perror("history: mmap");
+        return -1;
+    }
+    history.map = map;
+    history.mapSize = size;
+    return 0;
+}
+
+// Makes sure the file, and this shell's mapping of it, reach at least 'end' bytes
+int growHistory(uint64_t end) {
+    struct stat st;
+    flock(history.fd, LOCK_EX); // Another shell may be growing it too
+    int ok = fstat(history.fd, &st) == 0;
+    if (ok && (uint64_t)st.st_size < end) {
+        off_t size = st.st_size < HISTORY_MIN_SIZE ? HISTORY_MIN_SIZE : st.st_size;
+        while ((uint64_t)size < end) size *= 2;
+        ok = ftruncate(history.fd, size) == 0;
+        st.st_size = size;
+    }
+    flock(history.fd, LOCK_UN);
+    if (!ok) {
+        perror("history");
+        return -1;
+    }
+    return (size_t)st.st_size > history.mapSize ? mapHistory(st.st_size) : 0;
+}
+
+// Opens and maps the history file on first use; returns -1 if history is unavailable
+int openHistory() {
+    if (history.fd >= 0) return 0;
+    const char* path = historyPath();
+    if (history.failed || !path) return -1;
+    history.failed = 1;
+    history.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (history.fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (growHistory(HISTORY_HEADER_SIZE) < 0) {
+        close(history.fd);
+        history.fd = -1;
+        return -1;
+    }
+    // A new file reads as zeros; the first shell to get here claims it
+    HistoryHeader* header = (HistoryHeader*)history.map;
+    uint32_t blank = 0;
+    if (__atomic_compare_exchange_n(&header->magic, &blank, HISTORY_MAGIC, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        header->version = 1;
+        __atomic_store_n(&header->end, HISTORY_HEADER_SIZE, __ATOMIC_SEQ_CST);
+    } else if (blank != HISTORY_MAGIC) {
+        printf("shell24: %s is not a shell24 history file\n", path);
+        munmap(history.map, history.mapSize);
+        history.map = NULL;
+        close(history.fd);
+        history.fd = -1;
+        return -1;
+    }
+    while (__atomic_load_n(&header->end, __ATOMIC_ACQUIRE) == 0) ; // Claimed a moment ago
+    history.failed = 0;
+    history.indexedEnd = HISTORY_HEADER_SIZE;
+    return 0;
+}
+
+// Appends one line to the history file
+void recordHistory(const char* line) {
+    size_t len = strlen(line);
+    if (len == 0 || len > HISTORY_MAX_LINE || openHistory() < 0) return;
+    size_t size = (sizeof(HistoryRecord) + len + 7) & ~(size_t)7;
+    HistoryHeader* header = (HistoryHeader*)history.map;
+    uint64_t offset = __atomic_fetch_add(&header->end, size, __ATOMIC_SEQ_CST);
+    if (offset + size > history.mapSize && growHistory(offset + size) < 0) return;
+
+    HistoryRecord* record = (HistoryRecord*)(history.map + offset);
+    record->length = len | HISTORY_PENDING;
+    record->magic = HISTORY_RECORD_MAGIC;
+    memcpy(record + 1, line, len);
+    __atomic_store_n(&record->length, len, __ATOMIC_RELEASE);
+}
+
+void addHistoryBucket(HistoryBucket* bucket, uint32_t entry) {
+    if (bucket->count == bucket->capacity) {
+        bucket->capacity = bucket->capacity ? bucket->capacity * 2 : 4;
+        bucket->entries = memRealloc(MEM_HISTORY, bucket->entries, bucket->capacity * sizeof(uint32_t));
+    }
+    bucket->entries[bucket->count++] = entry;
+}
+
+unsigned int historyBucketKey(const char* text, size_t len) {
+    return (unsigned char)text[0] << 8 | (len > 1 ? (unsigned char)text[1] : 0);
+}
+
+// Adds entry to the list of every byte pair in its text, once per list. A pair found in a
+// large share of the entries would not narrow a search much and would hold most of the
+// index's memory, so its list is freed and the pair is not listed again.
+void indexHistoryText(uint32_t entry, const char* text, size_t len) {
+    for (size_t i = 1; i < len; i++) {
+        HistoryBucket* bucket = &history.pairs[historyBucketKey(text + i - 1, 2)];
+        if (bucket->common || (bucket->count && bucket->entries[bucket->count - 1] == entry)) continue;
+        if (bucket->count >= HISTORY_PAIR_MIN && bucket->count > entry / HISTORY_PAIR_SHARE) {
+            memFree(bucket->entries);
+            bucket->entries = NULL;
+            bucket->count = bucket->capacity = 0;
+            bucket->common = 1;
+            continue;
+        }
+        addHistoryBucket(bucket, entry);
+    }
+}
+
+const char* historyText(uint32_t entry, uint32_t* len) {
+    HistoryRecord* record = (HistoryRecord*)(history.map + history.offsets[entry]);
+    *len = record->length;
+    return (const char*)(record + 1);
+}
+
+// Returns the offset of the next record at or after 'from' that carries the record magic
+uint64_t resyncHistory(uint64_t from, uint64_t end) {
+    for (from += 8; from + sizeof(HistoryRecord) <= end; from += 8) {
+        HistoryRecord* record = (HistoryRecord*)(history.map + from);
+        if (record->magic == HISTORY_RECORD_MAGIC && record->length != 0) break;
+    }
+    return from;
+}
+
+// Indexes the records appended since the last call, by this or any other shell.
+// Entry numbers follow file order, so indexing stops at a record that is still being
+// written unless it has been unfinished for so long that its writer must have died.
+int indexHistory() {
+    if (openHistory() < 0) return -1;
+    uint64_t end = __atomic_load_n(&((HistoryHeader*)history.map)->end, __ATOMIC_ACQUIRE);
+    if (end > history.mapSize) growHistory(end);
+    if (end > history.mapSize) end = history.mapSize;
+    if (!history.buckets) {
+        history.buckets = memCalloc(MEM_HISTORY, 1 << 16, sizeof(HistoryBucket));
+        history.pairs = memCalloc(MEM_HISTORY, 1 << 16, sizeof(HistoryBucket));
+    }
+
+    uint64_t offset = history.indexedEnd;
+    while (offset + sizeof(HistoryRecord) <= end) {
+        HistoryRecord* record = (HistoryRecord*)(history.map + offset);
+        uint32_t length = __atomic_load_n(&record->length, __ATOMIC_ACQUIRE);
+        uint64_t size = (sizeof(HistoryRecord) + (length & ~HISTORY_PENDING) + 7) & ~7ULL;
+        if (length == 0 || (length & HISTORY_PENDING) || offset + size > end) {
+            uint64_t now = monotonicMicros();
+            if (history.stuckOffset != offset) {
+                history.stuckOffset = offset;
+                history.stuckSinceUs = now;
+                break;
+            }
+            if (now - history.stuckSinceUs < HISTORY_STUCK_US) break;
+            // Abandoned: skip it, finding the next record by its magic if no length was written
+            offset = length == 0 ? resyncHistory(offset, end) : offset + size;
+            continue;
+        }
+
+        if (history.count == history.capacity) {
+            history.capacity = history.capacity ? history.capacity * 2 : 1024;
+            history.offsets = memRealloc(MEM_HISTORY, history.offsets, history.capacity * sizeof(uint64_t));
+        }
+        const char* text = (const char*)(record + 1);
+        history.offsets[history.count] = offset;
+        indexHistoryText(history.count, text, length);
+        addHistoryBucket(&history.buckets[historyBucketKey(text, length)], history.count);
+        history.count++;
+        offset += size;
+    }
+    history.indexedEnd = offset;
+    return 0;
+}
+
+// Most recent entry starting with prefix, or -1
+long findHistoryPrefix(const char* prefix, size_t len) {
+    long best = -1;
+    if (len == 1) {
+        // Every bucket whose first byte matches; each one's last entry is its most recent
+        for (unsigned int second = 0; second < 256; second++) {
+            HistoryBucket* bucket = &history.buckets[(unsigned char)prefix[0] << 8 | second];
+            if (bucket->count && (long)bucket->entries[bucket->count - 1] > best) {
+                best = bucket->entries[bucket->count - 1];
+            }
+        }
+        return best;
+    }
+    HistoryBucket* bucket = &history.buckets[historyBucketKey(prefix, len)];
+    for (uint32_t i = bucket->count; i > 0; i--) {
+        uint32_t textLen;
+        const char* text = historyText(bucket->entries[i - 1], &textLen);
+        if (textLen >= len && memcmp(text, prefix, len) == 0) return bucket->entries[i - 1];
+    }
+    return -1;
+}
+
+// Entries that may contain needle: those listed under its rarest byte pair. NULL when it
+// has no listed pair (one byte, or only common pairs) and every entry has to be searched.
+HistoryBucket* historyCandidates(const char* needle, size_t len) {
+    HistoryBucket* bucket = NULL;
+    for (size_t i = 1; i < len; i++) {
+        HistoryBucket* pair = &history.pairs[historyBucketKey(needle + i - 1, 2)];
+        if (!pair->common && (!bucket || pair->count < bucket->count)) bucket = pair;
+    }
+    return bucket;
+}
+
+void printHistoryEntry(uint32_t entry) {
+    uint32_t len;
+    const char* text = historyText(entry, &len);
+    printf("%5u  %.*s\n", entry + 1, (int)len, text);
+}
+
+// Replaces a leading '!n', '!-n', '!!' or '!prefix' word with the history entry it names.
+// Returns line itself if there is nothing to expand, and NULL if the entry does not exist.
+char* expandHistory(char* line) {
+    if (line[0] != '!' || line[1] == '\0' || isspace((unsigned char)line[1]) || line[1] == '=') {
+        return line;
+    }
+    size_t wordLen = strcspn(line, " \t");
+    long entry = -1;
+    if (indexHistory() == 0) {
+        char* end;
+        if (line[1] == '!' && wordLen == 2) {
+            entry = (long)history.count - 1;
+        } else if (isdigit((unsigned char)line[1]) || (line[1] == '-' && isdigit((unsigned char)line[2]))) {
+            long n = strtol(line + 1, &end, 10);
+            if ((size_t)(end - line) == wordLen) entry = n < 0 ? (long)history.count + n : n - 1;
+        } else {
+            entry = findHistoryPrefix(line + 1, wordLen - 1);
+        }
+    }
+    if (entry < 0 || entry >= (long)history.count) {
+        printf("shell24: %.*s: event not found\n", (int)wordLen, line);
+        return NULL;
+    }
+
+    uint32_t len;
+    const char* text = historyText(entry, &len);
+    size_t rest = strlen(line + wordLen);
+    if (history.expandedCap < len + rest + 1) {
+        history.expandedCap = len + rest + 1;
+        history.expanded = memRealloc(MEM_HISTORY, history.expanded, history.expandedCap);
+    }
+    memcpy(history.expanded, text, len);
+    memcpy(history.expanded + len, line + wordLen, rest + 1);
+    printf("%s\n", history.expanded); // Show what runs, like other shells do
+    return history.expanded;
+}
+
+// history [N] | history -s TEXT
+int historyBuiltin(int argc, char** argv) {
+    if (indexHistory() < 0) {
+        printf("history: no history file\n");
+        return 1;
+    }
+    if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+        const char* needle = argv[2];
+        size_t needleLen = strlen(needle);
+        if (needleLen == 0) return 0;
+        HistoryBucket* bucket = historyCandidates(needle, needleLen);
+        uint32_t count = bucket ? bucket->count : history.count;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t entry = bucket ? bucket->entries[i] : i, len;
+            const char* text = historyText(entry, &len);
+            if (memmem(text, len, needle, needleLen)) printHistoryEntry(entry);
+        }
+        return 0;
+    }
+    if (argc > 1 && argv[1][0] == '-') {
+        printf("Usage: history [N] | history -s TEXT\n");
+        return 2;
+    }
+    uint32_t first = 0;
+    if (argc > 1) {
+        long last = atol(argv[1]);
+        if (last >= 0 && (uint32_t)last < history.count) first = history.count - last;
+    }
+    for (uint32_t i = first; i < history.count; i++) {
+        printHistoryEntry(i);
+    }
+    return 0;
+}
+
+// Resident set size of the shell in kB, 0 if /proc is not available
+long residentKilobytes() {
+    long pages = 0, resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "re");
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(fp);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Handles 'memstat': live heap bytes and blocks per owner, with allocation counts and the
+// peak, then the mapped history file and the resident set size
+int memstatBuiltin(int argc, char** argv) {
+    MemUsage total = {0};
+    printf("%-12s %12s %10s %12s %12s %12s\n", "owner", "live bytes", "blocks", "allocs", "frees", "peak bytes");
+    for (int i = 0; i < MEM_OWNERS; i++) {
+        MemUsage* usage = &memUsage[i];
+        printf("%-12s %12zu %10llu %12llu %12llu %12zu\n", memOwnerNames[i], usage->liveBytes,
+               (unsigned long long)usage->liveBlocks, (unsigned long long)usage->allocations,
+               (unsigned long long)usage->frees, usage->peakBytes);
+        total.liveBytes += usage->liveBytes;
+        total.liveBlocks += usage->liveBlocks;
+        total.allocations += usage->allocations;
+        total.frees += usage->frees;
+    }
+    printf("%-12s %12zu %10llu %12llu %12llu\n", "total", total.liveBytes, (unsigned long long)total.liveBlocks,
+           (unsigned long long)total.allocations, (unsigned long long)total.frees);
+    printf("history map  %zu bytes\n", history.map ? history.mapSize : 0);
+    printf("buffers      %lld bytes\n", (long long)totalBufferBytes());
+    printf("rss          %ld kB\n", residentKilobytes());
+    return 0;
+}
+
+int changeDirectory(int argc, char** argv) {
+    chdir(argc > 1 ? argv[1] : getenv("HOME"));
+    cwdGeneration++;
+    return 0;
+}
+
+int exitShell(int argc, char** argv) {
+    exit(argc > 1 ? atoi(argv[1]) : 0);
+}
+
+typedef int (*BuiltinFunc)(int argc, char** argv);
+
+// Commands handled inside the shell process instead of being launched
+typedef struct {
+    const char* name;
+    BuiltinFunc func;
+    int unlimitedArgs;  // Arguments are not held to MAX_ARGS (e.g. whole command lines)
+    int replacesProgram; // Stands in for an external program: forked when run with '&'
+} Builtin;
+
+Builtin builtins[] = {
+    {"cd", changeDirectory},
+    {"exit", exitShell},
+    {"set", setShellOption},
+    {"hash", hashBuiltin},
+    {"stats", statsBuiltin, 1},
+    {"fg", foregroundBuiltin},
+    {"bg", backgroundBuiltin},
+    {"jobs", jobsBuiltin},
+    {"wait", waitBuiltin},
+    {"newt", newtBuiltin},
+    {"sessions", sessionsBuiltin},
+    {"attach", attachBuiltin},
+    {"parallel", parallelBuiltin, 1},
+    {"echo", echoBuiltin, 0, 1},
+    {"printf", printfBuiltin, 0, 1},
+    {"true", trueBuiltin, 0, 1},
+    {"false", falseBuiltin, 0, 1},
+    {"test", testBuiltin, 0, 1},
+    {"[", testBuiltin, 0, 1},
+    {"cat", catBuiltin, 0, 1},
+    {"memo", memoBuiltin, 1, 1},
+    {"history", historyBuiltin},
+    {"memstat", memstatBuiltin},
+    {"redir", redirBuiltin},
+    {"buffers", buffersBuiltin},
+    {"drop", dropBuiltin},
+};
+
+Builtin* lookupBuiltin(const char* name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+BuiltinFunc findBuiltin(const char* name) {
+    Builtin* builtin = lookupBuiltin(name);
+    return builtin ? builtin->func : NULL;
+}
+
+int handlePipedCommands(Command* stages, int stageCount, int bg);
+
+int executeSingleCommand(Command* cmd, int shouldFork, int bg) {
+    char** arr = cmd->argv;
+    if (cmd->argc == 0) {
+        return 0;
+    }
+    Builtin* builtin = cmd->isConcat ? NULL : lookupBuiltin(arr[0]);
+
+    // Already inside a forked child (pipeline stage): redirect, then run the shell code or
+    // replace this process
+    if (!shouldFork) {
+        applyRedirections(cmd->fileIP, cmd->fileOP, cmd->outputMode);
+        if (cmd->isConcat) {
+            concatenateFiles(cmd->argv, cmd->argc);
+            exit(0);
+        }
+        if (builtin) {
+            int status = builtin->func(cmd->argc, arr);
+            if (status != BUILTIN_EXTERNAL) {
+                fflush(stdout);
+                exit(status);
+            }
+        }
+        execResolvedCommand(arr);
+    }
+
+    // Files joined by '#' and builtins run inside the shell, with the shell's own stdin and
+    // stdout redirected around them. With '&', '>|', 'run' or 'timeout' they are forked like any other job.
+    if ((cmd->isConcat || builtin) && cmd->teeCount == 0 && !cmd->limits && !cmd->timeoutMs && !(bg && (cmd->isConcat || builtin->replacesProgram))) {
+        int saved[2];
+        if (redirectShellFds(cmd->fileIP, cmd->fileOP, cmd->outputMode, saved) < 0) {
+            return EXIT_FAILURE << 8;
+        }
+        ProcessTiming timing;
+        startProcessTiming(&timing, cmd, monotonicMicros());
+        int status = 0;
+        if (cmd->isConcat) {
+            concatenateFiles(cmd->argv, cmd->argc);
+        } else {
+            status = builtin->func(cmd->argc, arr);
+        }
+        restoreShellFds(saved);
+        if (status != BUILTIN_EXTERNAL) {
+            finishProcessTiming(&timing, currentLine, getpid(), status << 8, NULL);
+            return status << 8; // Report it like a wait status
+        }
+    }
+
+    // Launched from the shell itself: a one-stage pipeline, with job control
+    return handlePipedCommands(cmd, 1, bg);
+}
+
+// One destination of a '>|' fan-out helper
+typedef struct {
+    int fd;
+    int copyRead, copyWrite;    // Pipe the file's copy waits in; unused for the final sink
+    int mode;                   // SINK_SPLICE, SINK_COPY or SINK_CLOSED
+} FanOutSink;
+
+#define SINK_SPLICE 0
+#define SINK_COPY 1     // splice was refused (append mode, terminal, ...): buffered copy
+#define SINK_CLOSED 2   // A write failed (e.g. the reader is gone); data is drained and dropped
+
+// Moves exactly len bytes out of the pipe 'from' into the sink
+void drainIntoSink(int from, FanOutSink* sink, size_t len, char* buffer) {
+    while (len > 0) {
+        ssize_t moved;
+        if (sink->mode == SINK_SPLICE) {
+            moved = splice(from, NULL, sink->fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (moved < 0 && errno == EINVAL) {
+                sink->mode = SINK_COPY;
+                continue;
+            }
+            if (moved < 0 && errno != EINTR) {
+                sink->mode = SINK_CLOSED;
+                continue;
+            }
+        } else {
+            moved = read(from, buffer, len < CONCAT_BUFFER_SIZE ? len : CONCAT_BUFFER_SIZE);
+            if (moved > 0 && sink->mode == SINK_COPY && writeAll(sink->fd, buffer, moved) < 0) {
+                sink->mode = SINK_CLOSED;
+            }
+            if (moved < 0 && errno != EINTR) return;
+        }
+        if (moved == 0) return;
+        if (moved > 0) len -= moved;
+    }
+}
+
+// Copies the pipe inFd to every sink; the last sink is the stream's final destination.
+// Data stays in the kernel: tee(2) duplicates what is buffered in inFd into each file's
+// copy pipe without consuming it, then splice(2) moves the copies to the files and the
+// original to the final sink. Returns -1 if a sink failed.
+int fanOutStream(int inFd, FanOutSink* sinks, int sinkCount) {
+    int capacity = fcntl(inFd, F_GETPIPE_SZ);
+    if (capacity <= 0) capacity = 65536;
+    char* buffer = memAlloc(MEM_IO, CONCAT_BUFFER_SIZE);
+    int copies = sinkCount - 1;
+
+    while (1) {
+        ssize_t len = tee(inFd, sinks[0].copyWrite, capacity, 0);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break; // End of the stream
+        // The copy pipes are drained every round and as large as inFd, so each one takes
+        // exactly the same bytes
+        for (int i = 1; i < copies; i++) {
+            ssize_t copied;
+            while ((copied = tee(inFd, sinks[i].copyWrite, len, 0)) < 0 && errno == EINTR) ;
+            if (copied != len) sinks[i].mode = SINK_CLOSED;
+            if (copied > 0 && copied != len) drainIntoSink(sinks[i].copyRead, &sinks[i], copied, buffer);
+        }
+        drainIntoSink(inFd, &sinks[copies], len, buffer);
+        for (int i = 0; i < copies; i++) {
+            drainIntoSink(sinks[i].copyRead, &sinks[i], len, buffer);
+        }
+    }
+    memFree(buffer);
+
+    for (int i = 0; i < sinkCount; i++) {
+        if (sinks[i].mode == SINK_CLOSED) return -1;
+    }
+    return 0;
+}
+
+// Forks the helper behind 'cmd >| file...'. It reads the stage's output from inFd and
+// writes it to every '>|' file and to the stage's own destination: its '>' target, else
+// outFd, else the shell's stdout. unused lists shell descriptors the helper must not keep
+// open (pipe ends that would hide EOF from other stages). Returns the helper's pid.
+pid_t startFanOut(Command* cmd, int inFd, int outFd, int* unused, int unusedCount, pid_t pgid) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid < 0) {
+            perror("fork");
+        } else if (pgid >= 0) {
+            setpgid(pid, pgid ? pgid : pid);
+        }
+        return pid;
+    }
+
+    if (pgid >= 0) setpgid(0, pgid);
+    becomeShellChild();
+    signal(SIGPIPE, SIG_IGN); // A reader that goes away only closes its sink
+    for (int i = 0; i < unusedCount; i++) {
+        if (unused[i] >= 0 && unused[i] != outFd) close(unused[i]);
+    }
+
+    int status = 0;
+    FanOutSink* sinks = memCalloc(MEM_IO, cmd->teeCount + 1, sizeof(FanOutSink));
+    int sinkCount = 0;
+    for (int i = 0; i < cmd->teeCount; i++) {
+        FanOutSink* sink = &sinks[sinkCount];
+        int copy[2];
+        sink->fd = open(cmd->teeFiles[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (sink->fd < 0) {
+            perror("Failed to open output file");
+            status = 1;
+            continue;
+        }
+        if (pipe2(copy, O_CLOEXEC) < 0) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        fcntl(copy[1], F_SETPIPE_SZ, fcntl(inFd, F_GETPIPE_SZ));
+        sink->copyRead = copy[0];
+        sink->copyWrite = copy[1];
+        sinkCount++;
+    }
+
+    FanOutSink* final = &sinks[sinkCount++];
+    final->fd = outFd >= 0 ? outFd : STDOUT_FILENO;
+    if (cmd->fileOP) {
+        int flags = O_WRONLY | O_CREAT | (cmd->outputMode == OUTPUT_APPEND ? O_APPEND : O_TRUNC);
+        final->fd = open(cmd->fileOP, flags, 0666);
+        if (final->fd < 0) {
+            perror("Failed to open output file");
+            final->mode = SINK_CLOSED;
+            status = 1;
+        }
+    }
+
+    if (sinkCount == 1) {
+        // Every '>|' file failed to open: pass the stream on unchanged
+        struct stat outStat;
+        if (final->fd >= 0 && fstat(final->fd, &outStat) == 0) {
+            dup2(final->fd, STDOUT_FILENO);
+            copyToStdout(inFd, outStat.st_mode);
+        }
+    } else if (fanOutStream(inFd, sinks, sinkCount) < 0) {
+        status = 1;
+    }
+    exit(status);
+}
+
+// Starts one pipeline stage. External commands go through the spawn engine; builtins and
+// '#' concatenation need shell code in the child, so only those stages are forked.
+// unusedFd is the read end of the stage's own output pipe: a forked stage has to close it
+// like exec would, or it never sees EPIPE when its reader exits.
+pid_t launchStage(Command* cmd, int inFd, int outFd, int unusedFd, pid_t pgid) {
+    if (cmd->isConcat || findBuiltin(cmd->argv[0]) != NULL) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (pgid >= 0) setpgid(0, pgid);
+            becomeShellChild();
+            if (cmd->limits) applyProcessLimits(cmd->limits, cmd->stageIndex);
+            if (inFd >= 0) dup2(inFd, STDIN_FILENO);
+            if (outFd >= 0) dup2(outFd, STDOUT_FILENO);
+            if (inFd > STDERR_FILENO) close(inFd);
+            if (outFd > STDERR_FILENO) close(outFd);
+            if (unusedFd >= 0) close(unusedFd);
+            stdinRing = cmd->inRing;
+            stdoutRing = cmd->outRing;
+            if (stdoutRing) {
+                close(stdoutRing->aliveRead); // Only the reader may hold it
+                stdoutRing->aliveRead = -1;
+            }
+            executeSingleCommand(cmd, 0, 0); // Exits with the stage's status
+        } else if (pid < 0) {
+            perror("fork");
+        } else if (pgid >= 0) {
+            setpgid(pid, pgid ? pgid : pid);
+        }
+        return pid;
+    }
+    return spawnCommand(cmd, inFd, outFd, pgid);
+}
+
+// Starts the stages of a pipeline as processes of job, joined by pipes. The last stage
+// writes to outFd, or to the shell's stdout when it is -1. Stages that could not be started
+// are recorded as failed.
+void startPipeline(Command* stages, int stageCount, Job* job, int outFd) {
+    int inFd = -1; // Read end of the previous stage's pipe
+    RingBuffer* inRing = NULL; // Or the previous stage's ring
+    ProcessLimits* limits = stages[0].limits;
+    if (limits && (limits->memoryMax || limits->cpuQuotaUs)) {
+        if (createLimitCgroup(limits) < 0) {
+            for (int i = 0; i < stageCount; i++) addFailedJobProcess(job);
+            return;
+        }
+        job->cgroup = limits->cgroup;
+    }
+
+    for (int i = 0; i < stageCount; i++) {
+        int pd[2] = {-1, outFd};
+        RingBuffer* outRing = NULL;
+        // Two in-shell stages in a row share a ring instead of a pipe
+        if (i < stageCount - 1 && ringSize > 0 && !limits && canWriteRing(&stages[i]) && canReadRing(&stages[i + 1])) {
+            outRing = createRing(&lineArena, ringSize);
+        }
+        if (outRing) {
+            pd[1] = -1;
+        } else if (i < stageCount - 1) {
+            if (pipe2(pd, O_CLOEXEC) < 0) {
+                perror("pipe");
+                while (i++ < stageCount) addFailedJobProcess(job); // Run nothing more
+                break;
+            }
+            if (pipeCapacity > 0) {
+                fcntl(pd[1], F_SETPIPE_SZ, pipeCapacity); // Best effort, capped by pipe-max-size
+            }
+        }
+
+        // With '>|' the stage writes into a pipe read by a fan-out helper, which also takes
+        // over the stage's '>' target. The helper joins the job first, so the stage's status
+        // still decides the pipeline's.
+        Command stage = stages[i];
+        stage.limits = limits;
+        stage.stageIndex = i;
+        stage.inRing = inRing;
+        stage.outRing = outRing;
+        int stageOutFd = pd[1];
+        if (stage.teeCount > 0) {
+            int fan[2];
+            if (pipe2(fan, O_CLOEXEC) < 0) {
+                perror("pipe");
+                stage.teeCount = 0;
             } else {
-                // Memory allocation failed, return the original command
-                return command;
+                int unused[] = {inFd, pd[0], fan[1]};
+                pid_t helper = startFanOut(&stage, fan[0], pd[1], unused, 3, job->ownGroup ? job->pgid : -1);
+                if (helper > 0) {
+                    addJobProcess(job, helper);
+                } else {
+                    addFailedJobProcess(job);
+                }
+                close(fan[0]);
+                stageOutFd = fan[1];
+                stage.fileOP = NULL;
             }
         }
+
+        uint64_t spawnStartUs = monotonicMicros();
+        pid_t pid = launchStage(&stage, inFd, stageOutFd, pd[0], job->ownGroup ? job->pgid : -1);
+        if (pid > 0) {
+            addJobProcess(job, pid);
+            startProcessTiming(&job->timings[job->pidCount - 1], &stages[i], spawnStartUs);
+        } else {
+            addFailedJobProcess(job);
+        }
+
+        // The shell keeps no pipe ends: the stages hold their own copies
+        if (stageOutFd != pd[1]) close(stageOutFd);
+        if (inFd >= 0) close(inFd);
+        if (i < stageCount - 1 && pd[1] >= 0) close(pd[1]);
+        inFd = pd[0];
+        if (inRing) closeRing(inRing);
+        if (outRing) {
+            close(outRing->aliveWrite); // Only the writer may hold it
+            outRing->aliveWrite = -1;
+        }
+        inRing = outRing;
+    }
+    if (inFd >= 0) close(inFd);
+    if (inRing) closeRing(inRing);
+}
+
+// This function manages the execution of piped commands. Every stage is started by the
+// shell itself, pipe ends are closed as soon as the stage that uses them is running, and
+// the stages form one job. A foreground job is waited for and its wait status returned
+// (see jobStatus); a background job goes to the job table.
+int handlePipedCommands(Command* stages, int stageCount, int bg) {
+    // A deadline needs a process group to signal, also without job control
+    long timeoutMs = stages[0].timeoutMs ? stages[0].timeoutMs : bg ? 0 : commandDeadlineMs;
+    Job* job = createJob(stageCount, bg || jobControl || timeoutMs > 0);
+    job->command = describeCommands(stages, stageCount);
+    if (timeoutMs > 0) setJobDeadline(job, timeoutMs, stages[0].timeoutMs ? stages[0].killAfterMs : -1);
+    startPipeline(stages, stageCount, job, -1);
+
+    if (job->running == 0) {
+        int status = jobStatus(job);
+        freeJob(job);
+        return status;
+    }
+    if (bg) {
+        addJob(job);
+        printf("[%d] Background process running with PID: %d\n", job->id, job->pids[job->pidCount - 1]);
+        return 0;
+    }
+    return waitForJob(job, 1);
+}
+
+// Writes all of buf to fd, retrying short writes
+int writeAll(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Last resort copy through a large user-space buffer
+int copyWithBuffer(int inFd, int outFd) {
+    static char* buffer = NULL;
+    if (buffer == NULL) {
+        buffer = memAlloc(MEM_IO, CONCAT_BUFFER_SIZE);
+        if (buffer == NULL) return -1;
+    }
+    ssize_t n;
+    while ((n = read(inFd, buffer, CONCAT_BUFFER_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (writeAll(outFd, buffer, n) < 0) return -1;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+// Moves a whole file into outFd inside the kernel. Returns 0 when done, 1 when the
+// method is not supported for this fd pair (nothing written yet), -1 on error.
+int copyFileZeroCopy(int inFd, int outFd, mode_t outType) {
+    int pipeOut = S_ISFIFO(outType);
+    int method = S_ISREG(outType) ? 0 : pipeOut ? 1 : 2; // copy_file_range, splice, sendfile
+    int copiedAny = 0;
+
+    while (method <= 2) {
+        ssize_t n;
+        if (method == 0) {
+            n = copy_file_range(inFd, NULL, outFd, NULL, CONCAT_CHUNK, 0);
+        } else if (method == 1) {
+            n = splice(inFd, NULL, outFd, NULL, CONCAT_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            n = sendfile(outFd, inFd, NULL, CONCAT_CHUNK);
+        }
+
+        if (n > 0) {
+            copiedAny = 1;
+        } else if (n == 0) {
+            return 0; // End of input
+        } else if (errno == EINTR) {
+            continue;
+        } else if (!copiedAny && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                                  errno == EOPNOTSUPP || errno == EBADF)) {
+            // This pair of fds cannot use the method; try the next one (splice is pipe only)
+            method = (method == 0 && !pipeOut) ? 2 : method + 1;
+        } else if (copiedAny && (errno == EINVAL || errno == ENOSYS)) {
+            return copyWithBuffer(inFd, outFd); // Continue from the current input offset
+        } else {
+            return -1;
+        }
+    }
+    return 1;
+}
+#endif
+
+// Concatenates any number of files and prints the result to stdout.
+// Data is moved with copy_file_range (regular file stdout), splice (pipe stdout) or
+// sendfile, falling back to a large read/write buffer only when none of those apply.
+void concatenateFiles(char **files, int numFiles) {
+    struct stat outStat;
+    fflush(stdout); // Anything printed through stdio must come before the file data
+    if (fstat(STDOUT_FILENO, &outStat) < 0) {
+        outStat.st_mode = 0;
+    }
+
+    for (int i = 0; i < numFiles; i++) {
+        int fd = open(files[i], O_RDONLY);
+        if (fd < 0) {
+            perror("Failed to open file");  // This will now print the file name causing the issue
+            continue;
+        }
+        if (copyToStdout(fd, outStat.st_mode) < 0) {
+            perror(files[i]);
+        }
+        close(fd);
+    }
+}
+
+// Copies everything left in fd to stdout, whose file type is outType; used by '#' and
+// 'cat'. Returns -1 on a read or write error.
+int copyToStdout(int fd, mode_t outType) {
+    if (stdoutRing) return fillRingFromFd(stdoutRing, fd);
+    int result = 1;
+#ifdef __linux__
+    struct stat inStat;
+    if (fstat(fd, &inStat) == 0 && S_ISREG(inStat.st_mode)) {
+        // Tell the kernel the whole file is read once, front to back
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        readahead(fd, 0, inStat.st_size < CONCAT_READAHEAD ? inStat.st_size : CONCAT_READAHEAD);
+    }
+    result = copyFileZeroCopy(fd, STDOUT_FILENO, outType);
+#endif
+    if (result > 0) {
+        result = copyWithBuffer(fd, STDOUT_FILENO);
+    }
+    return result;
+}
+
+// Validates the number of arguments and special characters in a command
+int validateArgsAndSpecialChars(Command* commands, int count) {
+    // Loop to ensure each command has an acceptable number of arguments
+    for (int index = 0; index < count; index++) {
+        // Files joined by '#' and builtins taking command lines have no upper limit
+        int argc = commands[index].argc;
+        int unlimited = commands[index].isConcat ||
+                        (argc > 0 && lookupBuiltin(commands[index].argv[0]) && lookupBuiltin(commands[index].argv[0])->unlimitedArgs);
+        if (argc < 1 || (argc > MAX_ARGS && !unlimited)) {
+            printf("ERROR: Each command must have 1 to 5 arguments.\nPlease try again.\n");
+            return 0;
+        }
+    }
+    return 1; // All commands and special characters are valid
+}
+
+// Compiled form of a command line: a sequence of and-or lists (each ended by ';' or '&'),
+// each a chain of pipelines joined by '&&' / '||', each a run of commands joined by '|'.
+// A line is compiled once; plans of lines seen before come from planCache.
+typedef enum {
+    PLAN_ALWAYS,        // First pipeline of a list
+    PLAN_IF_SUCCESS,    // After '&&'
+    PLAN_IF_FAILURE,    // After '||'
+} PlanCondition;
+
+typedef struct {
+    PlanCondition condition;
+    int hasGlobs;       // Stages are copied before their patterns are expanded
+    int hasSubsts;      // Stages are copied before their '$(...)' are run and expanded
+    int hasBuffers;     // Stages are copied before '@name' targets are resolved
+    Command* stages;
+    int stageCount;
+} PlanPipeline;
+
+typedef struct {
+    PlanPipeline* pipelines;
+    int pipelineCount;
+    int background;     // Ended by '&': the whole list is one background job
+    int timedFrom;      // Pipeline a 'time' prefix starts at; timed to the end of the list. -1 for none
+} PlanList;
+
+typedef struct Plan {
+    PlanList* lists;
+    int listCount;
+    char* line;         // Cache key
+    Arena arena;        // Holds the plan and its commands when it is cached
+    struct Plan* hashNext;
+    struct Plan* newer;  // LRU order
+    struct Plan* older;
+} Plan;
+
+// Groups parsed commands into a plan, allocated from arena. Returns 0, or 1 if the
+// commands fail validation (the message is printed).
+int compilePlan(Arena* arena, Command* commands, int count, Plan* plan) {
+    if (!validateArgsAndSpecialChars(commands, count)) return 1;
+
+    // Every command could start a list of its own
+    plan->lists = arenaAlloc(arena, count * sizeof(PlanList));
+    PlanPipeline* pipelines = arenaAlloc(arena, count * sizeof(PlanPipeline));
+    plan->listCount = 0;
+
+    PlanList* list = NULL;
+    PlanCondition condition = PLAN_ALWAYS;
+    for (int index = 0; index < count;) {
+        int last = index;
+        while (last < count - 1 && commands[last].next == TOK_PIPE) last++;
+
+        if (list == NULL) {
+            list = &plan->lists[plan->listCount++];
+            list->pipelines = pipelines;
+            list->pipelineCount = 0;
+            list->background = 0;
+            list->timedFrom = -1;
+        }
+        // 'time' covers the rest of the and-or list it prefixes
+        if (commands[index].timed && list->timedFrom < 0) list->timedFrom = list->pipelineCount;
+        PlanPipeline* pipeline = &list->pipelines[list->pipelineCount++];
+        pipelines++;
+        pipeline->condition = condition;
+        pipeline->stages = &commands[index];
+        pipeline->stageCount = last - index + 1;
+        pipeline->hasGlobs = pipeline->hasSubsts = pipeline->hasBuffers = 0;
+        for (int i = index; i <= last; i++) {
+            if (commands[i].globs) pipeline->hasGlobs = 1;
+            if (commands[i].substs) pipeline->hasSubsts = 1;
+            if (usesBuffers(&commands[i])) pipeline->hasBuffers = 1;
+        }
+
+        TokenType next = commands[last].next;
+        condition = next == TOK_AND ? PLAN_IF_SUCCESS : next == TOK_OR ? PLAN_IF_FAILURE : PLAN_ALWAYS;
+        if (condition == PLAN_ALWAYS) {
+            list->background = (next == TOK_BG);
+            list = NULL;
+        }
+        index = last + 1;
+    }
+    return 0;
+}
+
+// Wall clock and resource usage at the start of a 'time'd part of a line
+typedef struct {
+    struct rusage self;
+    struct rusage children;
+    uint64_t startUs;
+} TimeReport;
+
+void startTimeReport(TimeReport* report) {
+    report->children = childUsage;
+    childUsage.ru_maxrss = 0;
+    getrusage(RUSAGE_SELF, &report->self);
+    report->startUs = monotonicMicros();
+}
+
+// Reports on stderr the wall clock time and the resources used by the shell and by every
+// process reaped since startTimeReport
+void printTimeReport(TimeReport* report) {
+    struct rusage selfAfter;
+    struct rusage* selfBefore = &report->self;
+    struct rusage* childBefore = &report->children;
+    uint64_t wallUs = monotonicMicros() - report->startUs;
+    getrusage(RUSAGE_SELF, &selfAfter);
+    uint64_t userUs = timevalMicros(selfAfter.ru_utime) - timevalMicros(selfBefore->ru_utime) +
+                      timevalMicros(childUsage.ru_utime) - timevalMicros(childBefore->ru_utime);
+    uint64_t sysUs = timevalMicros(selfAfter.ru_stime) - timevalMicros(selfBefore->ru_stime) +
+                     timevalMicros(childUsage.ru_stime) - timevalMicros(childBefore->ru_stime);
+    long voluntary = selfAfter.ru_nvcsw - selfBefore->ru_nvcsw + childUsage.ru_nvcsw - childBefore->ru_nvcsw;
+    long involuntary = selfAfter.ru_nivcsw - selfBefore->ru_nivcsw + childUsage.ru_nivcsw - childBefore->ru_nivcsw;
+    // Largest child; the shell's own peak when only builtins ran
+    long maxRss = childUsage.ru_maxrss ? childUsage.ru_maxrss : selfAfter.ru_maxrss;
+    if (childBefore->ru_maxrss > childUsage.ru_maxrss) childUsage.ru_maxrss = childBefore->ru_maxrss;
+
+    fflush(stdout);
+    fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\nmaxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+            wallUs / 1e6, userUs / 1e6, sysUs / 1e6, maxRss, voluntary, involuntary);
+}
+
+// Runs one pipeline and returns its wait status. A cached plan is never modified: stages
+// with glob patterns are expanded in a copy that lives in lineArena.
+void expandCommandSubstitutions(Arena* arena, Command* commands, int count);
+
+int runPlanPipeline(PlanPipeline* pipeline, int bg) {
+    Command* stages = pipeline->stages;
+    int status = EXIT_FAILURE << 8;
+    if (pipeline->hasGlobs || pipeline->hasSubsts || pipeline->hasBuffers) {
+        stages = arenaAlloc(&lineArena, pipeline->stageCount * sizeof(Command));
+        memcpy(stages, pipeline->stages, pipeline->stageCount * sizeof(Command));
+        expandCommandSubstitutions(&lineArena, stages, pipeline->stageCount);
+        expandCommandGlobs(&lineArena, stages, pipeline->stageCount);
+    }
+    if (!pipeline->hasBuffers || resolveBufferTargets(&lineArena, stages, pipeline->stageCount) == 0) {
+        status = pipeline->stageCount > 1 ? handlePipedCommands(stages, pipeline->stageCount, bg)
+                                          : executeSingleCommand(stages, 1, bg);
+    }
+    return status;
+}
+
+// Runs an and-or list: '&&' runs the next pipeline only after success and '||' only
+// after failure; a skipped pipeline keeps the previous status, so 'a && b || c' runs c
+// when either a or b fails.
+int runPlanList(PlanList* list, int bg) {
+    int lastResult = 0; // Wait status of the last pipeline that ran
+    TimeReport report;
+    for (int i = 0; i < list->pipelineCount; i++) {
+        if (i == list->timedFrom) startTimeReport(&report);
+        PlanPipeline* pipeline = &list->pipelines[i];
+        int run = pipeline->condition == PLAN_IF_SUCCESS ? lastResult == 0 :
+                  pipeline->condition == PLAN_IF_FAILURE ? lastResult != 0 : 1;
+        if (run) lastResult = runPlanPipeline(pipeline, bg);
+    }
+    if (list->timedFrom >= 0) printTimeReport(&report);
+    return lastResult;
+}
+
+// '&' after a chain such as 'a && b' puts the whole chain in the background: a forked
+// copy of the shell runs it as one job
+int runPlanListInBackground(PlanList* list) {
+    PlanPipeline* last = &list->pipelines[list->pipelineCount - 1];
+    int commandCount = last->stages + last->stageCount - list->pipelines[0].stages;
+    Job* job = createJob(1, 1);
+    job->command = describeCommands(list->pipelines[0].stages, commandCount);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        becomeShellChild();
+        int status = runPlanList(list, 0);
+        fflush(stdout);
+        exit(exitCodeFromStatus(status));
+    }
+    if (pid < 0) {
+        perror("fork");
+        freeJob(job);
+        return EXIT_FAILURE << 8;
     }
-    // If '~' was not found or HOME is not set, return the original command
-    return command;
+    setpgid(pid, pid);
+    job->pgid = pid;
+    addJobProcess(job, pid);
+    addJob(job);
+    printf("[%d] Background process running with PID: %d\n", job->id, pid);
+    return 0;
 }
 
-
-// This function checks if a character in a string is preceded by an odd number of backslashes, indicating escape
-int isCharEscaped(const char* inputString, int position) {
-    // Only start checking if we are not at the beginning of the string and the previous character is a backslash
-    if (position > 0 && inputString[position - 1] == '\\') {
-        int backslashCount = 0; // Counter for consecutive backslashes
-        // Move backwards through the string as long as we encounter backslashes
-        while (position > 0 && inputString[position - 1] == '\\') {
-            backslashCount++;  // Increment backslash count
-            position--;        // Move to the previous character
+// Runs a compiled line; returns the wait status of the last pipeline that ran
+int runPlan(Plan* plan) {
+    int status = 0;
+    for (int i = 0; i < plan->listCount; i++) {
+        PlanList* list = &plan->lists[i];
+        if (list->background && list->pipelineCount > 1) {
+            status = runPlanListInBackground(list);
+        } else {
+            status = runPlanList(list, list->background);
         }
-        // If the number of consecutive backslashes is odd, the character is considered escaped
-        return (backslashCount % 2) == 1;
     }
-    // If not starting with a backslash or at the start of the string, it's not escaped
-    return 0;
+    return status;
 }
 
+// Plans of recently run lines, so a line that repeats (e.g. in a loop of a generated
+// script) is not lexed, parsed and validated again
+#define PLAN_CACHE_SIZE 256
+#define PLAN_CACHE_BUCKETS 512
+#define PLAN_CACHE_MAX_LINE 4096      // Longer lines are compiled every time
+#define PLAN_ARENA_BLOCK_SIZE 2048
 
-// Removes white spaces from the beginning and end of the string
-char* trimWhitespace(char *arggs) {
-    int i;
-    while (isspace (*arggs)) {
-        arggs++;  
+Plan* planBuckets[PLAN_CACHE_BUCKETS];
+Plan* newestPlan = NULL;
+Plan* oldestPlan = NULL;
+int cachedPlanCount = 0;
+struct {
+    unsigned long hits, misses;
+} planStats;
+
+unsigned int hashLine(const char* line, size_t len) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)line[i]) * 16777619u;
     }
-    for (i = strlen (arggs) - 1; (isspace (arggs[i])); i--) ;   
-    arggs[i + 1] = '\0';
-    
-    return arggs;
+    return hash % PLAN_CACHE_BUCKETS;
 }
 
-char* safeStrdupAndTrim(char *str) {
-    char* trimmed = trimWhitespace(str);
-    return strdup(trimmed); // Duplicate the trimmed string
+void unlinkPlanLru(Plan* plan) {
+    if (plan->newer) plan->newer->older = plan->older;
+    else newestPlan = plan->older;
+    if (plan->older) plan->older->newer = plan->newer;
+    else oldestPlan = plan->newer;
 }
 
-// This function formats a command string by adding spaces around special characters
-char* formatCommandArguments(const char* originalCommand) {
-    const char* specialChars = "<>|&;#";  // Define special characters
-    const char* doubleSpecialChars = ">|&";  // Special characters that can be doubled
-    size_t originalLength = strlen(originalCommand);
-    char* newCommand = malloc(originalLength * 2 + 1); // Allocate memory for the new formatted command
-    size_t indexOriginal = 0, indexNew = 0;
+void pushPlanLru(Plan* plan) {
+    plan->older = newestPlan;
+    plan->newer = NULL;
+    if (newestPlan) newestPlan->newer = plan;
+    newestPlan = plan;
+    if (!oldestPlan) oldestPlan = plan;
+}
 
-    // Iterate through the original command string
-    while (indexOriginal < originalLength) {
-        // Check if current character is special and not escaped
-        if (strchr(specialChars, originalCommand[indexOriginal]) != NULL && !isCharEscaped(originalCommand, indexOriginal)) {
-            
-            // Check for double special characters (e.g., >>) and add spaces accordingly
-            if (strchr(doubleSpecialChars, originalCommand[indexOriginal]) != NULL &&
-                indexOriginal + 1 < originalLength &&
-                originalCommand[indexOriginal] == originalCommand[indexOriginal + 1]) {
-                newCommand[indexNew++] = ' ';
-                newCommand[indexNew++] = originalCommand[indexOriginal++];
-                newCommand[indexNew++] = originalCommand[indexOriginal];  // Same as previous char, hence no increment
-                newCommand[indexNew++] = ' ';
-                newCommand[indexNew++] = ' ';
-            } else {
-                // Single special character, just add space before and after
-                newCommand[indexNew++] = ' ';
-                newCommand[indexNew++] = originalCommand[indexOriginal];
-                newCommand[indexNew++] = ' ';
-            }
-        } else {
-            // Normal character, just copy
-            newCommand[indexNew++] = originalCommand[indexOriginal];
+Plan* findCachedPlan(const char* line, size_t len) {
+    for (Plan* plan = planBuckets[hashLine(line, len)]; plan; plan = plan->hashNext) {
+        if (strcmp(plan->line, line) == 0) {
+            unlinkPlanLru(plan);
+            pushPlanLru(plan);
+            return plan;
         }
-        indexOriginal++; // Move to the next character in the original command
-    }
-
-    // Terminate the new command string
-    newCommand[indexNew] = '\0';
-    return newCommand;
-}
-
-// Validates the count of arguments in a command against predefined limits
-int validateCommandArguments(char* inputArgs) {
-    char* commandCopy = strdup(inputArgs); // Create a duplicate of the input to preserve the original data
-    commandCopy = trimWhitespace(commandCopy); // Remove leading and trailing spaces from the command
-    char* token = strtok(commandCopy, " "); // Split the command by spaces
-    int count = 0; // Initialize argument count
-
-    // Iterate over all parts of the command
-    while (token != NULL) {
-        token = strtok(NULL, " "); // Move to the next argument
-        count++; // Increment the argument count
-    }
-
-    //free(commandCopy); // Free the duplicated command string after use
-    return count >= 1 && count <= MAX_ARGS; // Check if count is within the allowed range
-}
-
-// Splits a command string into tokens based on special control characters
-int partitionCommandArguments(char *input, char **tokens) {
-    int count = 0;  // Initialize token count
-    size_t length = strlen(input);
-    size_t start = 0;  // Starting index for each token
-
-    for (size_t idx = 0; idx < length; idx++) {
-        // Identifying control sequences like &&, ||, |, ;
-        if (strncmp(input + idx, "&&", 2) == 0)
-        {
-            tokens[count] = malloc((idx - start + 1) * sizeof(char)); 
-            strncpy(tokens[count++], input + start, idx - start);
-            tokens[count++] = "&&";
-            idx++;
-            start = idx + 2;
-        } 
-        // CHECK FOR OCCURENCE FOR || IN ARGUMENT
-        else if (strncmp(input + idx, "||", 2) == 0)
-        {
-            tokens[count] = malloc((idx - start + 1) * sizeof(char));
-            strncpy(tokens[count++], input + start, idx - start);
-            tokens[count++] = "||";
-            idx++;
-            start = idx + 2;
-        }
-
-        // CHECK FOR OCCURENCE FOR | IN ARGUMENT
-        else if (input[idx] == '|')
-        {
-            tokens[count] = malloc((idx - start + 1) * sizeof(char));
-            strncpy(tokens[count++], input + start, idx - start);
-            tokens[count++] = "|";
-            start = idx + 1;
-        }
-
-        // CHECK FOR OCCURENCE FOR ; IN ARGUMENT
-        else if (input[idx] == ';')
-        {
-            tokens[count] = malloc((idx - start + 1) * sizeof(char));
-            strncpy(tokens[count++], input + start, idx - start);
-            tokens[count++] = ";";
-            start = idx + 1;
-        }
-
-        // CHECK FOR OCCURENCE FOR # IN ARGUMENT
-        else if (input[idx] == '#')
-        {
-            tokens[count] = malloc((idx - start + 1) * sizeof(char));
-            strncpy(tokens[count++], input + start, idx - start);
-            tokens[count++] = "#";
-            start = idx + 1;
-        }
-    }
-
-    // Capture the final token, if any, after the last special character
-    // if (start < length) {
-    //     tokens[count] = malloc((length - start + 1) * sizeof(char));
-    //     strncpy(tokens[count], input + start, length - start);
-    //     tokens[count++][length - start] = '\0'; // Null-terminate the final token
-    // }
-    tokens[count] = malloc((length - start + 1) * sizeof(char));
-    strncpy(tokens[count++], input + start, length - start);
-
-    return count; // Return the total number of tokens generated
-}
-
-
-int executeSingleCommand(char* argument, int shouldFork){
-    char *arr[10];   // Stores parsed command arguments
-    char* cmnd = strdup(argument);
-    cmnd = trimWhitespace(cmnd); // Clean command from unnecessary spaces
-    int outputMode = OUTPUT_TRUNC;  // Default output redirection mode
-    int bg = 0; // Flag for background execution
+    }
+    return NULL;
+}
 
-    char *fileIP = NULL; // Stores name of file for input redirection
-    char *fileOP = NULL; // Stores name of file for output redirection
-    int i = 0;
+void evictOldestPlan() {
+    Plan* plan = oldestPlan;
+    unlinkPlanLru(plan);
+    Plan** link = &planBuckets[hashLine(plan->line, strlen(plan->line))];
+    while (*link != plan) link = &(*link)->hashNext;
+    *link = plan->hashNext;
+    arenaFree(&plan->arena);
+    memFree(plan);
+    cachedPlanCount--;
+}
+
+// Lexes, parses and compiles line into plan, allocating from arena. Returns 0 on success
+// (an empty line gives a plan with no lists), 2 for a syntax error and 1 if validation failed.
+int compileLine(Arena* arena, const char* line, size_t len, Plan* plan) {
+    Token* tokens;
+    Command* commands;
+    plan->listCount = 0;
+    int tokenCount = lexCommandLine(arena, line, len, &tokens);
+    if (tokenCount <= 0) return tokenCount < 0 ? 2 : 0;
+    int commandCount = parseCommandLine(arena, tokens, tokenCount, &commands);
+    if (commandCount <= 0) return commandCount < 0 ? 2 : 0;
+    return compilePlan(arena, commands, commandCount, plan);
+}
 
-    // Detect background process indicator & handle it
-    if (cmnd[strlen(cmnd) - 1] == '&') {
-        bg = 1;
-        cmnd[strlen(cmnd) - 1] = '\0';  // Remove '&' from command
-        cmnd = trimWhitespace(cmnd);  // Clean command again after removal
+// Returns the plan for line: the cached one, or a newly compiled one that is cached when
+// it compiled cleanly. *status is 0, or the exit status of a line that did not compile.
+Plan* planForLine(const char* line, int* status) {
+    static Plan uncached;
+    size_t len = strlen(line);
+    uint64_t startUs = monotonicMicros();
+    *status = 0;
+    Plan* plan = len <= PLAN_CACHE_MAX_LINE ? findCachedPlan(line, len) : NULL;
+    if (plan) {
+        planStats.hits++;
+        lineParseUs = monotonicMicros() - startUs;
+        return plan;
     }
+    planStats.misses++;
 
-    if (strcmp(cmnd, "exit") == 0) {
-        exit(0);
+    if (len > PLAN_CACHE_MAX_LINE) {
+        *status = compileLine(&lineArena, line, len, &uncached);
+        lineParseUs = monotonicMicros() - startUs;
+        return &uncached;
+    }
+    plan = memCalloc(MEM_PLANS, 1, sizeof(Plan));
+    plan->arena.blockSize = PLAN_ARENA_BLOCK_SIZE;
+    plan->arena.owner = MEM_PLANS;
+    *status = compileLine(&plan->arena, line, len, plan);
+    lineParseUs = monotonicMicros() - startUs;
+    if (*status != 0 || plan->listCount == 0) {
+        // Not cached: errors are reported again each time the line comes
+        uncached = *plan;
+        uncached.listCount = 0;
+        arenaFree(&plan->arena);
+        memFree(plan);
+        return &uncached;
     }
 
-    if (strcmp(cmnd, "cd") == 0) {
-        chdir(getenv("HOME"));
-        return 0;
-    } 
-    
-    else if (strstr(cmnd, "cd ") == cmnd) {
-        char* dir = cmnd + 3; 
-        dir = trimWhitespace(dir);
-        chdir(dir);
-        return 0;
+    if (cachedPlanCount == PLAN_CACHE_SIZE) evictOldestPlan();
+    plan->line = arenaStrndup(&plan->arena, line, len);
+    unsigned int bucket = hashLine(line, len);
+    plan->hashNext = planBuckets[bucket];
+    planBuckets[bucket] = plan;
+    pushPlanLru(plan);
+    cachedPlanCount++;
+    return plan;
+}
+
+// Command substitution. '$(line)' runs line when the command around it is about to start
+// and its output replaces it: split into words on spaces, tabs and newlines, or kept as
+// one word inside "...", trailing newlines removed either way. Output is captured in a
+// memfd rather than a pipe, so it never waits on a 64 KB pipe buffer and is read back
+// with one pread of its exact size. A single builtin that stands in for a program (echo,
+// printf, cat, test, ...) runs inside the shell; anything else runs in a forked child.
+#define SUBST_KEEP_BYTES (1 << 20) // Larger captures are truncated away once read
+
+// The command of a line that is one simple command, or NULL when it needs the whole plan
+Command* simpleSubstitution(Plan* plan) {
+    if (plan->listCount != 1) return NULL;
+    PlanList* list = &plan->lists[0];
+    if (list->pipelineCount != 1 || list->timedFrom >= 0 || list->background || list->pipelines[0].stageCount != 1) return NULL;
+    Command* cmd = list->pipelines[0].stages;
+    int dynamicName = cmd->substs && cmd->substs[0];
+    if (cmd->isConcat || cmd->teeCount || cmd->limits || cmd->timeoutMs || dynamicName) return NULL;
+    return cmd;
+}
+
+// Runs line with its stdout in captureFd; returns the output in the arena, with its
+// length (trailing newlines removed) in len
+char* captureSubstitution(Arena* arena, const char* line, size_t* len) {
+    *len = 0;
+    Plan plan;
+    if (compileLine(arena, line, strlen(line), &plan) != 0 || plan.listCount == 0) return "";
+
+    // A simple command is expanded here, so its own substitutions run once
+    Command* simple = simpleSubstitution(&plan);
+    Command cmd;
+    if (simple) {
+        cmd = *simple;
+        expandCommandSubstitutions(arena, &cmd, 1);
+        expandCommandGlobs(arena, &cmd, 1);
+        if (resolveBufferTargets(arena, &cmd, 1) < 0) return "";
+        simple = &cmd;
     }
+    if (captureFd < 0) {
+        captureFd = memfd_create("shell24-subst", MFD_CLOEXEC);
+        if (captureFd < 0) {
+            perror("memfd_create");
+            return "";
+        }
+    }
+    ftruncate(captureFd, 0);
+    lseek(captureFd, 0, SEEK_SET);
+    fflush(stdout);
 
-    // Parse the command and redirections
-    char *tkn, *nxtTkn;
-    tkn = strtok_r(cmnd, " ", &nxtTkn);
-    while (tkn != NULL) {
-        if (strcmp(tkn, "<") == 0) {
-            fileIP = strtok_r(NULL, " ", &nxtTkn);
-        } else if (strcmp(tkn, ">") == 0) {
-            fileOP = strtok_r(NULL, " ", &nxtTkn);
-            outputMode = OUTPUT_TRUNC;
-        } else if (strcmp(tkn, ">>") == 0) {
-            fileOP = strtok_r(NULL, " ", &nxtTkn);
-            outputMode = OUTPUT_APPEND;
+    int status = BUILTIN_EXTERNAL;
+    Builtin* builtin = simple && cmd.argc > 0 ? lookupBuiltin(cmd.argv[0]) : NULL;
+    if (builtin && builtin->replacesProgram) {
+        int savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(captureFd, STDOUT_FILENO);
+        int saved[2];
+        if (redirectShellFds(cmd.fileIP, cmd.fileOP, cmd.outputMode, saved) == 0) {
+            status = builtin->func(cmd.argc, cmd.argv);
+            restoreShellFds(saved);
         } else {
-            arr[i++] = tkn;
+            status = EXIT_FAILURE;
         }
-        tkn = strtok_r(NULL, " ", &nxtTkn);
+        fflush(stdout);
+        dup2(savedOut, STDOUT_FILENO);
+        close(savedOut);
     }
-    arr[i] = NULL; // Null-terminate the argument list
-
-    // Handling forking if necessary
-    int pid = 0;
-    if (shouldFork) {
-        pid = fork();
+    if (status == BUILTIN_EXTERNAL && !(simple && cmd.argc == 0)) {
+        ftruncate(captureFd, 0);
+        lseek(captureFd, 0, SEEK_SET);
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(captureFd, STDOUT_FILENO);
+            becomeShellChild();
+            if (simple) executeSingleCommand(simple, 0, 0); // Does not return
+            int result = runPlan(&plan);
+            fflush(stdout);
+            exit(exitCodeFromStatus(result));
+        }
+        if (pid < 0) {
+            perror("fork");
+            return "";
+        }
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) ;
     }
 
-    // Child process
-    if (pid == 0 || !shouldFork) {
-        int fd_in, fd_out;
+    struct stat st;
+    if (fstat(captureFd, &st) < 0 || st.st_size == 0) return "";
+    char* output = arenaAlloc(arena, st.st_size + 1);
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+        ssize_t n = pread(captureFd, output + got, st.st_size - got, got);
+        if (n <= 0) break;
+        got += n;
+    }
+    if (got > SUBST_KEEP_BYTES) ftruncate(captureFd, 0);
+    while (got > 0 && output[got - 1] == '\n') got--;
+    output[got] = '\0';
+    *len = got;
+    return output;
+}
 
-        // Setup input redirection
-        if (fileIP) {
-            fd_in = open(fileIP, O_RDONLY);
-            if (fd_in < 0) {
-                perror("Failed to open input file");
-                exit(EXIT_FAILURE);
+// Writes the fields of one argument into out, each NUL-terminated, and returns how many
+// there are. out needs one byte more than the literal runs and outputs together: every
+// field's terminator replaces a separator, except the last one.
+int buildSubstFields(SubstWord* word, char** outputs, size_t* lens, char* out) {
+    int fields = 0;
+    int open = 0; // A field has been started and not yet terminated
+    for (int i = 0; i <= word->count; i++) {
+        size_t textLen = strlen(word->text[i]);
+        if (textLen > 0) {
+            memcpy(out, word->text[i], textLen);
+            out += textLen;
+            open = 1;
+        }
+        if (i == word->count) break;
+        if (word->quoted[i]) {
+            memcpy(out, outputs[i], lens[i]);
+            out += lens[i];
+            open = 1;
+            continue;
+        }
+        const char* p = outputs[i];
+        const char* end = p + lens[i];
+        for (; p < end; p++) {
+            if (*p == ' ' || *p == '\t' || *p == '\n') {
+                if (open) {
+                    *out++ = '\0';
+                    fields++;
+                    open = 0;
+                }
+            } else {
+                *out++ = *p;
+                open = 1;
             }
-            dup2(fd_in, STDIN_FILENO);
-            close(fd_in);
         }
+    }
+    if (open) {
+        *out = '\0';
+        fields++;
+    }
+    return fields;
+}
 
-        // Setup output redirection
-        if (fileOP) {
-            if (outputMode == OUTPUT_TRUNC) {
-                fd_out = open(fileOP, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            } else { // OUTPUT_APPEND
-                fd_out = open(fileOP, O_WRONLY | O_CREAT | O_APPEND, 0666);
+// Runs the substitutions in the commands' arguments and puts their words in place. Each
+// argument's words are split in one buffer; argv (and globs, kept in step) is built once.
+void expandCommandSubstitutions(Arena* arena, Command* commands, int count) {
+    for (int c = 0; c < count; c++) {
+        Command* cmd = &commands[c];
+        if (!cmd->substs) continue;
+        char** fields = arenaAlloc(arena, cmd->argc * sizeof(char*));
+        int* fieldCounts = arenaAlloc(arena, cmd->argc * sizeof(int));
+        int total = 0;
+        for (int i = 0; i < cmd->argc; i++) {
+            SubstWord* word = cmd->substs[i];
+            if (!word) {
+                fieldCounts[i] = 1;
+                total++;
+                continue;
             }
-            if (fd_out < 0) {
-                perror("Failed to open output file");
-                exit(EXIT_FAILURE);
+            char** outputs = arenaAlloc(arena, word->count * sizeof(char*));
+            size_t* lens = arenaAlloc(arena, word->count * sizeof(size_t));
+            size_t size = 1;
+            for (int k = 0; k <= word->count; k++) {
+                size += strlen(word->text[k]);
+                if (k < word->count) {
+                    outputs[k] = captureSubstitution(arena, word->lines[k], &lens[k]);
+                    size += lens[k];
+                }
             }
-            dup2(fd_out, STDOUT_FILENO);
-            close(fd_out);
+            fields[i] = arenaAlloc(arena, size);
+            fieldCounts[i] = buildSubstFields(word, outputs, lens, fields[i]);
+            total += fieldCounts[i];
         }
 
-        // Execute the command
-        if (execvp(arr[0], arr) < 0) {
-            printf("%s", arr[0]);
-            perror("Failed to execute command");
-            exit(EXIT_FAILURE);
-        }
-    } 
-    // Parent process
-    else {
-        if (!bg) {
-            int status;
-            waitpid(pid, &status, 0); // Wait for child to finish
-            return status;
-        } else {
-            printf("Background process running with PID: %d\n", pid);
-            last_background_pid = pid; // Save the background process ID
-            return 0;
+        char** argv = arenaAlloc(arena, (total + 1) * sizeof(char*));
+        char** globs = cmd->globs ? arenaAlloc(arena, total * sizeof(char*)) : NULL;
+        int n = 0;
+        for (int i = 0; i < cmd->argc; i++) {
+            if (!cmd->substs[i]) {
+                if (globs) globs[n] = cmd->globs[i];
+                argv[n++] = cmd->argv[i];
+                continue;
+            }
+            char* field = fields[i];
+            for (int f = 0; f < fieldCounts[i]; f++) {
+                if (globs) globs[n] = NULL;
+                argv[n++] = field;
+                field += strlen(field) + 1;
+            }
         }
+        argv[n] = NULL;
+        cmd->argv = argv;
+        cmd->argc = n;
+        cmd->globs = globs;
+        cmd->substs = NULL;
     }
-
-    // Only reached if shouldFork is false and no forking occurred
-    return 0;
 }
 
-// This function manages the execution of piped commands
-int handlePipedCommands(char** argts, int argCount) {
-    int pid = fork();
-    int i=0;
+// One command line run by 'parallel' and the output it produced so far
+typedef struct ParallelTask {
+    Job* job;
+    int outFd;              // Read end of the captured stdout, -1 once it reached EOF
+    char* output;           // Output held back until the earlier tasks are printed
+    size_t outputLen, outputCap;
+    struct ParallelTask* next;
+} ParallelTask;
 
-    // This is child process where pid = 0
-    if (!pid) {
-        for(  i=0; i<argCount-1; i+=2)
-        {
-            int pd[2];
-            pipe(pd);
-            if (!fork()) {
-                dup2(pd[1], 1); 
+Arena parallelArena = {NULL, ARENA_BLOCK_SIZE, MEM_PARALLEL}; // Parse space for one 'parallel' line at a time
 
-                // Execute command individually
-                executeSingleCommand(argts[i], 0);
-                printf("ERROR!!\n");
-            }
-            dup2(pd[0], 0);
-            close(pd[1]); // Close the write end since it's not needed anymore
-        }
+// Starts one command line without waiting for it. A single pipeline is launched straight
+// from the shell; lines with ';', '&&' or '||' need the shell's sequencing, so they run in
+// a forked copy of the shell. outFd (or -1) receives the line's stdout.
+Job* startParallelLine(char* line, int outFd) {
+    Plan plan;
+    uint64_t parseStartUs = monotonicMicros();
+    int failed = compileLine(&parallelArena, line, strlen(line), &plan);
+    lineParseUs = monotonicMicros() - parseStartUs;
+    if (failed || plan.listCount == 0) {
+        Job* job = createJob(1, 0);
+        addFailedJobProcess(job);
+        arenaReset(&parallelArena);
+        return job;
+    }
 
-        // Execute command individually
-        executeSingleCommand(argts[i], 0);
-    } 
+    PlanPipeline* pipeline = &plan.lists[0].pipelines[0];
+    int pipelineOnly = plan.listCount == 1 && plan.lists[0].pipelineCount == 1 &&
+                       !plan.lists[0].background && plan.lists[0].timedFrom < 0;
 
-    // This is the parent process where pid > 0
-    else if (pid > 0) {
-        char* cmnd = strdup(argts[argCount - 1]);
-        cmnd = trimWhitespace(cmnd);
-        if (cmnd[strlen(cmnd) - 1] != '&') {
-            waitpid(pid, NULL, 0);
+    Job* job = createJob(pipelineOnly ? pipeline->stageCount : 1, 0);
+    job->command = memStrdup(MEM_JOBS, line);
+    if (traceFile) {
+        memFree(job->line); // The task's own line, not the 'parallel' line
+        job->line = memStrdup(MEM_JOBS, line);
+    }
+    if (pipelineOnly) {
+        expandCommandSubstitutions(&parallelArena, pipeline->stages, pipeline->stageCount);
+        expandCommandGlobs(&parallelArena, pipeline->stages, pipeline->stageCount);
+        if (resolveBufferTargets(&parallelArena, pipeline->stages, pipeline->stageCount) < 0) {
+            for (int i = 0; i < pipeline->stageCount; i++) addFailedJobProcess(job);
+        } else {
+            startPipeline(pipeline->stages, pipeline->stageCount, job, outFd);
+        }
+    } else {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            becomeShellChild();
+            if (outFd >= 0) dup2(outFd, STDOUT_FILENO);
+            int status = runPlan(&plan);
+            fflush(stdout);
+            exit(exitCodeFromStatus(status));
+        }
+        if (pid > 0) {
+            addJobProcess(job, pid);
         } else {
-            printf("Background process running with PID: %d\n", pid);
+            perror("fork");
+            addFailedJobProcess(job);
         }
     }
+    arenaReset(&parallelArena);
+    return job;
 }
 
-// Concatenates up to 5 text files and prints the result to stdout.
-void concatenateFiles(char **files, int numFiles) {
-    const int BUFFER_SIZE = 1024;
-    char buffer[BUFFER_SIZE];
-    for (int i = 0; i < numFiles; i++) {
-        FILE *fp = fopen(files[i], "r");
-        if (!fp) {
-            perror("Failed to open file");  // This will now print the file name causing the issue
-            continue;
+// Collects exited children: those of the given tasks, then background jobs
+void reapParallelTasks(ParallelTask* tasks) {
+    childExited = 0;
+    char drain[64];
+    while (read(sigchldPipe[0], drain, sizeof(drain)) > 0) ;
+
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        Job* job = NULL;
+        for (ParallelTask* task = tasks; task && !job; task = task->next) {
+            for (int i = 0; i < task->job->pidCount; i++) {
+                if (task->job->pids[i] == pid) job = task->job;
+            }
         }
-        size_t bytesRead;
-        while ((bytesRead = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-            fwrite(buffer, 1, bytesRead, stdout);
+        if (job == NULL) job = findJobByPid(pid);
+        if (job) {
+            updateJobProcess(job, pid, status, &usage);
+        } else {
+            recordSessionExit(pid, status);
         }
-        fclose(fp);
     }
 }
 
-void executeCommandWithRedirection(char *command) {
-    // Example command: "cat file1.txt >> file2.txt"
-    char *args[64];
-    char *outputFile = NULL;
-    int fd;
-    int append = 0; // Flag for append mode
-
-    // Split the command into words
-    int i = 0;
-    char *token = strtok(command, " ");
-    while (token != NULL) {
-        if (strcmp(token, ">>") == 0) {
-            append = 1; // Set append flag
-            token = strtok(NULL, " "); // Get the next token, which should be the filename
-            outputFile = token;
+// Handles 'parallel [-j N] [-u] [-a FILE] [LINE...]': runs command lines with at most N
+// (default: online CPUs) at a time. Lines come from the arguments, from FILE, or from stdin.
+// Output is printed in input order unless -u lets it interleave as it is written.
+// Returns the number of lines that failed (101 for more than 100), like GNU parallel.
+int parallelBuiltin(int argc, char** argv) {
+    long maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int ordered = 1;
+    char* inputFile = NULL;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+            maxJobs = atol(argv[++argi]);
+        } else if (strncmp(argv[argi], "-j", 2) == 0 && argv[argi][2]) {
+            maxJobs = atol(argv[argi] + 2);
+        } else if (strcmp(argv[argi], "-u") == 0) {
+            ordered = 0;
+        } else if (strcmp(argv[argi], "-k") == 0) {
+            ordered = 1;
+        } else if (strcmp(argv[argi], "-a") == 0 && argi + 1 < argc) {
+            inputFile = argv[++argi];
+        } else if (strcmp(argv[argi], "--") == 0) {
+            argi++;
             break;
         } else {
-            args[i++] = token;
+            printf("parallel: usage: parallel [-j N] [-k|-u] [-a FILE] [LINE...]\n");
+            return 2;
         }
-        token = strtok(NULL, " ");
     }
-    args[i] = NULL; // Null-terminate the arguments array
+    if (maxJobs < 1) maxJobs = 1;
 
-    // Fork to execute the command
-    pid_t pid = fork();
-    if (pid == 0) { // Child process
-        if (outputFile) {
-            // Open the output file with appropriate flags
-            fd = open(outputFile, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
-            if (fd < 0) {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd, STDOUT_FILENO); // Redirect standard output to the file
-            close(fd); // Close the original file descriptor
-        }
-        // Execute the command
-        execvp(args[0], args);
-        // If execvp returns, there was an error
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    } else if (pid > 0) { // Parent process
-        int status;
-        waitpid(pid, &status, 0); // Wait for the child process to finish
-    } else {
-        perror("fork"); // Fork failed
-        exit(EXIT_FAILURE);
+    LineReader reader;
+    int fromArgs = (argi < argc);
+    if (!fromArgs) {
+        if (inputFile) {
+            if (openScriptReader(&reader, inputFile) < 0) return 2;
+        } else {
+            initLineReader(&reader, STDIN_FILENO, NULL, 0);
+        }
     }
-}
-
 
-// Manages the execution of parsed commands based on logical operators and piping
+    ParallelTask* head = NULL;  // Oldest task whose output is not fully printed yet
+    ParallelTask* tail = NULL;
+    int failed = 0, inputDone = 0;
+    char buffer[65536];
+    fflush(stdout);
 
-void processCommandTokens(char **tokens, int count) {
-
-    int lastResult = 1; // Stores the result of the last executed command
-    int index = 0; // Index for navigating through tokens
-    int executionResult = 0; // Result of current command execution
-
-    // Iterate through all command tokens
-    while (index < count) {
+    while (!inputDone || head) {
+        // Keep up to maxJobs lines running
+        int running = 0;
+        for (ParallelTask* task = head; task; task = task->next) {
+            running += task->job->running > 0;
+        }
+        while (!inputDone && running < maxJobs) {
+            char* line = fromArgs ? (argi < argc ? argv[argi++] : NULL) : readLine(&reader);
+            if (line == NULL) {
+                inputDone = 1;
+                break;
+            }
+            while (isspace((unsigned char)*line)) line++;
+            if (*line == '\0') continue;
 
-        // Handle the logical OR '||'
-        if (strcmp(tokens[index], "||") == 0) {
-            if (!lastResult) { // Skip to next significant command if last result was failure
-                index++;
-                while (index < count && strcmp(tokens[index], "&&") != 0 &&
-                       strcmp(tokens[index], "|") != 0 && strcmp(tokens[index], ";") != 0) {
-                    index++;
-                }
-                if (index < count && index>0 && strcmp(tokens[index], "|") == 0) index += 2;
-            } else {
-                index++;
-            }
-        } 
-        // Handle the logical AND '&&'
-        else if (strcmp(tokens[index], "&&") == 0) {
-            if (lastResult) { // Skip to next significant command if last result was success
-                index++;
-                while (index < count && strcmp(tokens[index], "||") != 0 &&
-                       strcmp(tokens[index], "|") != 0 && strcmp(tokens[index], ";") != 0) {
-                    index++;
-                }
-                if (index < count && index>0 && strcmp(tokens[index], "|") == 0) index += 2;
-            } else {
-                index++;
+            ParallelTask* task = memCalloc(MEM_PARALLEL, 1, sizeof(ParallelTask));
+            int pd[2] = {-1, -1};
+            if (ordered && pipe2(pd, O_CLOEXEC) < 0) {
+                perror("pipe");
             }
+            task->job = startParallelLine(line, pd[1]);
+            if (pd[1] >= 0) close(pd[1]);
+            task->outFd = pd[0];
+            if (tail) tail->next = task; else head = task;
+            tail = task;
+            running += task->job->running > 0;
         }
-        // Handle the pipe '|'
-        else if (strcmp(tokens[index], "|") == 0) {
-            index++;
-        } 
-        // Handle the semicolon ';'
-        else if (strcmp(tokens[index], ";") == 0) {
-            index++;
+
+        // Print finished tasks in order; the head task's output goes out as it arrives
+        while (head && head->job->running == 0 && head->outFd < 0) {
+            ParallelTask* task = head;
+            writeAll(STDOUT_FILENO, task->output, task->outputLen);
+            if (jobStatus(task->job) != 0) failed++;
+            head = task->next;
+            if (head == NULL) tail = NULL;
+            freeJob(task->job);
+            memFree(task->output);
+            memFree(task);
         }
-        // Handle the hashtag '#'
-        else if (strcmp(tokens[index], "#") == 0) {
-            index++;
+        if (head && head->outputLen) {
+            writeAll(STDOUT_FILENO, head->output, head->outputLen);
+            head->outputLen = 0;
         }
+        if (head == NULL) continue;
 
-        // Manage the execution of a sequence of piped commands
-        else if (index < count - 1 && strcmp(tokens[index + 1], "|") == 0) {
-            int startPosition = index;
-            while (index < count - 1 && strcmp(tokens[index + 1], "|") == 0) index += 2;
-            handlePipedCommands(tokens + startPosition, index - startPosition + 1);
-            index++;
+        // Wait for output or exiting children
+        int fdCount = 0;
+        for (ParallelTask* task = head; task; task = task->next) {
+            if (task->outFd >= 0) fdCount++;
+        }
+        struct pollfd* fds = arenaAlloc(&parallelArena, (fdCount + 1) * sizeof(struct pollfd));
+        ParallelTask** owners = arenaAlloc(&parallelArena, fdCount * sizeof(ParallelTask*));
+        int n = 0;
+        for (ParallelTask* task = head; task; task = task->next) {
+            if (task->outFd >= 0) {
+                fds[n].fd = task->outFd;
+                fds[n].events = POLLIN;
+                owners[n++] = task;
+            }
+        }
+        fds[n].fd = sigchldPipe[0];
+        fds[n].events = POLLIN;
+        if (!childExited && poll(fds, n + 1, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
         }
-        // Execute a standalone command
-        else {
 
-            char* individualCommands[5];  // Assuming a max of 5 arguments for simplicity
-            int argCount = partitionCommandArguments(tokens[index], individualCommands);  // This assumes you have a function to split commands into individual arguments; adjust as needed
-            int isValid = validateArgsAndSpecialChars(individualCommands, argCount);
-            if (!isValid) {
-                printf("Invalid number of arguments for command: %s\n", tokens[index]);
-                continue;  // Skip execution of this command due to invalid arguments
+        for (int i = 0; i < n; i++) {
+            if (!fds[i].revents) continue;
+            ParallelTask* task = owners[i];
+            ssize_t got = read(task->outFd, buffer, sizeof(buffer));
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) continue;
+                close(task->outFd);
+                task->outFd = -1;
+            } else if (task == head) {
+                writeAll(STDOUT_FILENO, buffer, got);
+            } else {
+                if (task->outputLen + got > task->outputCap) {
+                    task->outputCap = (task->outputLen + got) * 2;
+                    task->output = memRealloc(MEM_PARALLEL, task->output, task->outputCap);
+                }
+                memcpy(task->output + task->outputLen, buffer, got);
+                task->outputLen += got;
             }
+        }
+        arenaReset(&parallelArena);
 
-            executionResult = executeSingleCommand(tokens[index], 1);
-            lastResult = executionResult;
-            index++;
+        if (childExited || fds[n].revents) {
+            reapParallelTasks(head);
         }
     }
+
+    if (!fromArgs) {
+        closeLineReader(&reader);
+    }
+    return failed > 100 ? 101 : failed;
 }
 
+// Resumes a job if it is stopped and waits for it in the foreground
+int bringToForeground(Job* job) {
+    printf("Bringing job [%d] to the foreground: %s\n", job->id, job->command);
+    if (job->stopped) {
+        kill(-job->pgid, SIGCONT);
+        job->stopped = 0;
+    }
+    return waitForJob(job, 1);
+}
 
-// Validates the number of arguments and special characters in a command
-int validateArgsAndSpecialChars(char** arguments, int numOfArgs) {
-    // Verify the limit on the number of special characters
-    if (numOfArgs > 2 * MAX_PIPES - 1) {
-        printf("LIMIT EXCEEDED: Not many Special characters allowed.\n\n"); 
-        return 0; // Invalid if too many special characters
+// Handles 'fg [%n]'
+int foregroundBuiltin(int argc, char** argv) {
+    reapJobs();
+    Job* job = findJobSpec(argc, argv, "fg");
+    if (job == NULL) {
+        if (argc < 2) printf("No background process to bring to the foreground\n");
+        return 1;
     }
+    return exitCodeFromStatus(bringToForeground(job));
+}
 
-    // Loop to ensure each command has an acceptable number of arguments
-    for (int index = 0; index < numOfArgs; index++) {
-        // Skip odd indices as they represent special characters between commands
-        if (index % 2 != 0) continue;
+// Handles 'bg [%n]': continues a stopped job in the background
+int backgroundBuiltin(int argc, char** argv) {
+    reapJobs();
+    Job* job = findJobSpec(argc, argv, "bg");
+    if (job == NULL) {
+        if (argc < 2) printf("bg: no current job\n");
+        return 1;
+    }
+    if (job->stopped) {
+        kill(-job->pgid, SIGCONT);
+        job->stopped = 0;
+    }
+    printf("[%d]  %s &\n", job->id, job->command);
+    return 0;
+}
 
-        // Check if the number of arguments for the command is within the allowed range
-        int isValid = validateCommandArguments(arguments[index]);
-        if (!isValid) { // Command has invalid number of arguments
-            printf("ERROR: Each command must have 1 to 5 arguments.\nPlease try again.\n");
-            return 0;
+// Handles 'jobs': lists the job table and forgets jobs that have finished
+int jobsBuiltin(int argc, char** argv) {
+    reapJobs();
+    Job** link = &jobList;
+    while (*link) {
+        Job* job = *link;
+        printJobState(job);
+        if (job->running == 0) {
+            *link = job->next;
+            freeJob(job);
+        } else {
+            link = &job->next;
         }
     }
-    return 1; // All commands and special characters are valid
+    return 0;
 }
 
-void bringToForeground() {
-    if (last_background_pid > 0) {
-        int status;
-        printf("Bringing process %d to the foreground\n", last_background_pid);
-        waitpid(last_background_pid, &status, 0); // Wait for the process to finish
-        last_background_pid = -1; // Reset the last background process ID
-    } else {
-        printf("No background process to bring to the foreground\n");
+// Handles 'wait [%n]': waits for one job, or for every background job
+int waitBuiltin(int argc, char** argv) {
+    reapJobs();
+    if (argc > 1) {
+        Job* job = findJobSpec(argc, argv, "wait");
+        return job ? exitCodeFromStatus(waitForJob(job, 0)) : 127;
     }
+    int status = 0;
+    while (jobList) {
+        status = waitForJob(jobList, 0);
+        if (jobList && jobList->stopped) break; // A stopped job will not finish on its own
+    }
+    return exitCodeFromStatus(status);
 }
 
+// Sessions opened by 'newt': forked copies of this shell, each on a pseudo-terminal of its
+// own. Output a session writes while it is not attached is drained while the shell waits
+// for input, and the last SESSION_BACKLOG bytes of it are shown on 'attach'.
+#define SESSION_BACKLOG 65536
+#define SESSION_DETACH_KEY 0x1d // Ctrl-]
 
-int execute_newt_command() {
-    pid_t pid = fork(); // Create a new process
+typedef struct Session {
+    int id;
+    pid_t pid;
+    int masterFd;       // -1 once the session's terminal is gone
+    int exited;
+    int status;         // Wait status once exited
+    char* backlog;      // Ring buffer of output nobody has seen yet
+    size_t backlogStart, backlogLen;
+    struct Session* next;
+} Session;
 
-    if (pid < 0) {
-        // If fork fails, print an error message
-        perror("Fork failed");
-        return -1;
-    } else if (pid == 0) {
-        // Child process: Open a new terminal and run a new instance of the shell
-        execlp("xterm", "xterm", "-e", "./shell24", NULL);
+Session* sessionList = NULL;
+int nextSessionId = 1;
+volatile sig_atomic_t windowResized = 0;
 
-        // If execlp returns, there was an error
-        perror("Failed to start a new terminal");
-        exit(EXIT_FAILURE); // Exit if execlp fails
-    } else {
-        // Parent process: Return immediately, don't wait for the new terminal to close
-        return 0; 
+// Runs the shell loop of a new session; called in the child forkpty created
+void runSessionShell() {
+    // The parent's other sessions are not this one's
+    for (Session* session = sessionList; session; session = session->next) {
+        if (session->masterFd >= 0) close(session->masterFd);
     }
-}
+    sessionList = NULL;
+    becomeShellChild();
+    redirCache.owner = 0; // A shell of its own, which may build its own cache
+    initJobControl(1);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    fstat(STDIN_FILENO, &shellStdin);
 
+    LineReader reader;
+    initLineReader(&reader, STDIN_FILENO, NULL, 0);
+    reader.reapWhileWaiting = 1;
+    exit(runShellLoop(&reader, 1, 0));
+}
 
-// Entry point for the shell program
-int main() {
-    // Persistently accept user input
-    while (1) {
-        char* ipvar = malloc(4096); // Reserve space for command input
-        fflush(stdout);  // Ensure stdout is flushed before printing prompt
-        printf("shell24$ "); // Display the shell prompt
+// Starts a session: fork() onto a new pseudo-terminal, no exec, so the session begins
+// with this shell's state (path cache, plans, options) already in place
+Session* startSession() {
+    struct winsize size;
+    int hasSize = ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0;
+    int master;
+    fflush(stdout);
+    pid_t pid = forkpty(&master, NULL, NULL, hasSize ? &size : NULL);
+    if (pid < 0) {
+        perror("forkpty");
+        return NULL;
+    }
+    if (pid == 0) {
+        runSessionShell();
+    }
+    fcntl(master, F_SETFD, FD_CLOEXEC);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
 
-        fgets(ipvar, 1024, stdin); // Read the input from stdin
+    Session* session = memCalloc(MEM_SESSIONS, 1, sizeof(Session));
+    session->id = nextSessionId++;
+    session->pid = pid;
+    session->masterFd = master;
+    Session** link = &sessionList;
+    while (*link) link = &(*link)->next;
+    *link = session;
+    return session;
+}
 
-        ipvar = trimWhitespace(ipvar); // Trim leading and trailing spaces
+void freeSession(Session* session) {
+    if (session->masterFd >= 0) close(session->masterFd);
+    memFree(session->backlog);
+    memFree(session);
+}
 
-        //ipvar = replace_tilde_with_home(ipvar);
-        if (strchr(ipvar, '~') != NULL) {
-            char *expandedInput = replace_tilde_with_home(ipvar);
-            strcpy(ipvar, expandedInput);
-            free(expandedInput);
+// Keeps output of a detached session; the oldest bytes go once the backlog is full
+void addToBacklog(Session* session, const char* data, size_t len) {
+    if (!session->backlog) session->backlog = memAlloc(MEM_SESSIONS, SESSION_BACKLOG);
+    for (size_t i = 0; i < len; i++) {
+        size_t end = (session->backlogStart + session->backlogLen) % SESSION_BACKLOG;
+        session->backlog[end] = data[i];
+        if (session->backlogLen < SESSION_BACKLOG) {
+            session->backlogLen++;
+        } else {
+            session->backlogStart = (session->backlogStart + 1) % SESSION_BACKLOG;
         }
+    }
+}
+
+// Reads what a detached session wrote; closes its terminal once the session is gone
+void drainSession(Session* session) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(session->masterFd, buf, sizeof(buf))) > 0) {
+        addToBacklog(session, buf, n);
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        close(session->masterFd); // EIO: every process on the terminal has closed it
+        session->masterFd = -1;
+    }
+}
+
+// Adds the terminals of the sessions to a poll set; returns how many were added
+int sessionPollFds(struct pollfd* fds, int max) {
+    int count = 0;
+    for (Session* session = sessionList; session && count < max; session = session->next) {
+        if (session->masterFd < 0) continue;
+        fds[count].fd = session->masterFd;
+        fds[count].events = POLLIN;
+        fds[count++].revents = 0;
+    }
+    return count;
+}
 
-        // Check for empty input
-        if (strlen(ipvar) == 0) {
-            continue; // If input is empty, start the loop again
+void serviceSessions(struct pollfd* fds, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!fds[i].revents) continue;
+        for (Session* session = sessionList; session; session = session->next) {
+            if (session->masterFd == fds[i].fd) drainSession(session);
         }
+    }
+}
 
-        // Check for 'newt' command before processing other commands
-        if (strcmp(ipvar, "newt") == 0) {
-            execute_newt_command(); // Execute the 'newt' command
-            continue; // Skip the rest of the loop and wait for new input
+// Called for reaped children that belong to no job
+void recordSessionExit(pid_t pid, int status) {
+    for (Session* session = sessionList; session; session = session->next) {
+        if (session->pid == pid && !WIFSTOPPED(status) && !WIFCONTINUED(status)) {
+            session->exited = 1;
+            session->status = status;
         }
+    }
+}
+
+void handleWindowResize(int sig) {
+    windowResized = 1;
+}
+
+void copyWindowSize(int masterFd) {
+    struct winsize size;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0) {
+        ioctl(masterFd, TIOCSWINSZ, &size);
+    }
+}
+
+// Connects the shell's terminal to a session until Ctrl-] is typed or the session ends.
+// Returns 1 if the session ended.
+int attachSession(Session* session) {
+    struct termios saved;
+    int tty = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0;
+    printf("[attached to session %d; Ctrl-] detaches]\n", session->id);
+    fflush(stdout);
+    if (tty) {
+        struct termios raw = saved;
+        cfmakeraw(&raw);
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+        copyWindowSize(session->masterFd);
+    }
+    struct sigaction resize, previous;
+    memset(&resize, 0, sizeof(resize));
+    resize.sa_handler = handleWindowResize;
+    sigemptyset(&resize.sa_mask);
+    sigaction(SIGWINCH, &resize, &previous);
 
-        // Check for '#' character for file concatenation
-        if (strchr(ipvar, '#') != NULL) {
-            char *files[6]; // Supports up to 5 files
-            int numFiles = 0;
-            char *token = strtok(ipvar, "#");
-            while (token != NULL) {
-                token = trimWhitespace(token); // Trim the token in place, no need to duplicate
-                files[numFiles++] = strdup(token); // Duplicate after trimming
-                token = strtok(NULL, "#");
+    // What the session printed while it was detached comes first
+    if (session->backlogLen > 0) {
+        size_t first = SESSION_BACKLOG - session->backlogStart;
+        if (first > session->backlogLen) first = session->backlogLen;
+        writeAll(STDOUT_FILENO, session->backlog + session->backlogStart, first);
+        writeAll(STDOUT_FILENO, session->backlog, session->backlogLen - first);
+        session->backlogStart = session->backlogLen = 0;
+    }
+
+    int ended = 0, detached = 0;
+    char buf[4096];
+    while (!ended && !detached) {
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {session->masterFd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) break;
+            if (windowResized && tty) copyWindowSize(session->masterFd);
+            windowResized = 0;
+            continue;
+        }
+        if (fds[1].revents) {
+            ssize_t n = read(session->masterFd, buf, sizeof(buf));
+            if (n > 0) {
+                writeAll(STDOUT_FILENO, buf, n);
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                ended = 1;
             }
-            if(numFiles > 6) {
-                printf("ERROR: Each command must have 1 to 5 arguments.\nPlease try again.\n");
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0) {
+                detached = 1; // No more input to pass on
                 continue;
             }
-            concatenateFiles(files, numFiles); // Concatenate and display files
-            for (int i = 0; i < numFiles; i++) {
-                free(files[i]); // Free the duplicated strings
+            char* key = memchr(buf, SESSION_DETACH_KEY, n);
+            if (key) {
+                n = key - buf;
+                detached = 1;
             }
-            continue; // Skip further processing for this command
+            fcntl(session->masterFd, F_SETFL, fcntl(session->masterFd, F_GETFL) & ~O_NONBLOCK);
+            writeAll(session->masterFd, buf, n);
+            fcntl(session->masterFd, F_SETFL, fcntl(session->masterFd, F_GETFL) | O_NONBLOCK);
         }
+    }
 
-        // Check for '>>' character for output redirection
-        if (strstr(ipvar, ">>") != NULL) {
-            executeCommandWithRedirection(ipvar);
-            continue;
+    sigaction(SIGWINCH, &previous, NULL);
+    if (tty) tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+    if (ended) {
+        close(session->masterFd);
+        session->masterFd = -1;
+    }
+    printf(ended ? "\n[session %d ended]\n" : "\n[detached from session %d]\n", session->id);
+    return ended;
+}
+
+// Removes sessions whose shell has exited and whose output was seen
+void pruneSessions() {
+    reapJobs();
+    Session** link = &sessionList;
+    while (*link) {
+        Session* session = *link;
+        if (session->exited && session->masterFd < 0 && session->backlogLen == 0) {
+            *link = session->next;
+            freeSession(session);
+        } else {
+            link = &session->next;
+        }
+    }
+}
+
+int sessionsBuiltin(int argc, char** argv) {
+    reapJobs();
+    for (Session* session = sessionList; session; session = session->next) {
+        if (session->masterFd >= 0) drainSession(session);
+        printf("%3d  pid %-7d %s", session->id, (int)session->pid,
+               session->exited || session->masterFd < 0 ? "ended" : "running");
+        if (session->backlogLen > 0) printf("  %zu bytes not shown", session->backlogLen);
+        printf("\n");
+    }
+    pruneSessions();
+    return 0;
+}
+
+// attach [N]: session N, or the newest one still running
+int attachBuiltin(int argc, char** argv) {
+    Session* target = NULL;
+    for (Session* session = sessionList; session; session = session->next) {
+        if (argc > 1 ? session->id == atoi(argv[1]) : session->masterFd >= 0) target = session;
+    }
+    if (target == NULL) {
+        printf(argc > 1 ? "attach: %s: no such session\n" : "attach: no running session\n", argv[1]);
+        return 1;
+    }
+    if (target->masterFd < 0) {
+        printf("attach: session %d has ended\n", target->id);
+        pruneSessions();
+        return 1;
+    }
+    attachSession(target);
+    pruneSessions();
+    return 0;
+}
+
+int newtBuiltin(int argc, char** argv) {
+    return execute_newt_command() < 0;
+}
+
+// Opens a new shell24 session on a pseudo-terminal of its own; 'attach' switches to it
+int execute_newt_command() {
+    Session* session = startSession();
+    if (session == NULL) return -1;
+    printf("[session %d] started, pid %d; 'attach %d' switches to it\n", session->id, (int)session->pid, session->id);
+    return 0;
+}
+
+
+int lastStatus = 0; // Exit status of the last line that ran anything; blank lines keep it
+
+// Runs one line of input through the shell; the plan comes from the cache when the line
+// ran before, and everything the run allocates lives in lineArena.
+// Returns the exit status of the last command (2 for a syntax error), or the previous
+// line's status when this one has no commands.
+int executeLine(char* ipvar) {
+    int exitStatus;
+    currentLine = ipvar;
+    Plan* plan = planForLine(ipvar, &exitStatus);
+    if (exitStatus == 0) {
+        exitStatus = plan->listCount > 0 ? exitCodeFromStatus(runPlan(plan)) : lastStatus;
+    }
+    currentLine = NULL;
+    arenaReset(&lineArena);
+    lastStatus = exitStatus;
+    return exitStatus;
+}
+
+// Sends one frame of the --serve protocol
+int sendFrame(int fd, char type, const char* data, uint32_t len) {
+    char header[FRAME_HEADER_SIZE];
+    uint32_t netLen = htonl(len);
+    header[0] = type;
+    memcpy(header + 1, &netLen, 4);
+    if (writeAll(fd, header, FRAME_HEADER_SIZE) < 0) return -1;
+    return writeAll(fd, data, len);
+}
+
+// Reads exactly len bytes; returns -1 on EOF or error
+int readFull(int fd, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads one frame into *buf (grown as needed, NUL-terminated). Returns the frame type,
+// or -1 at the end of the connection or for an oversized frame.
+int readFrame(int fd, char** buf, size_t* cap, uint32_t* len) {
+    char header[FRAME_HEADER_SIZE];
+    if (readFull(fd, header, FRAME_HEADER_SIZE) < 0) return -1;
+    memcpy(len, header + 1, 4);
+    *len = ntohl(*len);
+    if (*len > FRAME_MAX_PAYLOAD) return -1;
+    if (*len + 1 > *cap) {
+        *cap = *len + 1;
+        *buf = memRealloc(MEM_SERVER, *buf, *cap);
+    }
+    if (readFull(fd, *buf, *len) < 0) return -1;
+    (*buf)[*len] = '\0';
+    return (unsigned char)header[0];
+}
+
+// Forwards the stdout and stderr pipes of a connection to the client as frames. An exit
+// status arriving on the control pipe is sent once all output written before it is out.
+void relayOutput(int conn, int outFd, int errFd, int controlFd) {
+    signal(SIGPIPE, SIG_IGN); // A vanished client only makes the writes fail
+    fcntl(outFd, F_SETFL, O_NONBLOCK);
+    fcntl(errFd, F_SETFL, O_NONBLOCK);
+    struct pollfd fds[3] = {{outFd, POLLIN, 0}, {errFd, POLLIN, 0}, {controlFd, POLLIN, 0}};
+    char buf[65536];
+
+    while (1) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        int drain = 0;
+        uint32_t status;
+        if (fds[2].revents) {
+            if (readFull(controlFd, (char*)&status, sizeof(status)) < 0) return; // Connection done
+            drain = 1;
         }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || (!fds[i].revents && !drain)) continue;
+            ssize_t n;
+            while ((n = read(fds[i].fd, buf, sizeof(buf))) > 0) {
+                sendFrame(conn, i == 0 ? FRAME_STDOUT : FRAME_STDERR, buf, n);
+                if (!drain) break; // Let the other stream take turns
+            }
+            if (n == 0) fds[i].fd = -1;
+        }
+        if (drain) {
+            sendFrame(conn, FRAME_EXIT, (char*)&status, sizeof(status));
+        }
+    }
+}
+
+// Runs the command lines of one client. Output goes through pipes to a relay process that
+// frames it, so long outputs stream while the line still runs.
+void serveConnection(int conn) {
+    int outPipe[2], errPipe[2], controlPipe[2];
+    if (pipe2(outPipe, O_CLOEXEC) < 0 || pipe2(errPipe, O_CLOEXEC) < 0 || pipe2(controlPipe, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return;
+    }
+    pid_t relay = fork();
+    if (relay == 0) {
+        close(outPipe[1]);
+        close(errPipe[1]);
+        close(controlPipe[1]);
+        relayOutput(conn, outPipe[0], errPipe[0], controlPipe[0]);
+        _exit(0);
+    }
+    close(outPipe[0]);
+    close(errPipe[0]);
+    close(controlPipe[0]);
 
-        if (strcmp(ipvar, "fg") == 0) {
-            bringToForeground(); // Handle 'fg' command
-            continue; // Skip the rest of the loop and wait for new input
+    int saved[3];
+    for (int fd = 0; fd < 3; fd++) saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    int devNull = open("/dev/null", O_RDONLY);
+    dup2(devNull, STDIN_FILENO);
+    close(devNull);
+    dup2(outPipe[1], STDOUT_FILENO);
+    dup2(errPipe[1], STDERR_FILENO);
+
+    char* line = NULL;
+    size_t cap = 0;
+    uint32_t len;
+    while (relay > 0 && readFrame(conn, &line, &cap, &len) == FRAME_LINE) {
+        uint32_t status = htonl(executeLine(line));
+        fflush(stdout);
+        fflush(stderr);
+        writeAll(controlPipe[1], (char*)&status, sizeof(status));
+    }
+    memFree(line);
+
+    for (int fd = 0; fd < 3; fd++) {
+        dup2(saved[fd], fd);
+        close(saved[fd]);
+    }
+    close(outPipe[1]);
+    close(errPipe[1]);
+    close(controlPipe[1]);
+    if (relay > 0) waitpid(relay, NULL, 0);
+}
+
+// Forks one pre-started worker; workers take turns accepting clients
+pid_t startServeWorker(int listenFd) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid < 0) perror("fork");
+        return pid;
+    }
+    becomeShellChild();
+    redirCache.owner = 0; // Runs requests for as long as the server does; may cache its own targets
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    int homeDir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    while (1) {
+        int conn = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            exit(EXIT_FAILURE);
         }
+        fchdir(homeDir); // Every client starts in the daemon's directory
+        cwdGeneration++;
+        serveConnection(conn);
+        close(conn);
+        notifyFinishedJobs(0); // Background jobs of the client are dropped silently
+    }
+}
+
+volatile sig_atomic_t serveStopping = 0;
+
+void handleServeStop(int sig) {
+    serveStopping = 1;
+}
+
+// Handles 'shell24 --serve PATH [--workers N]': accepts command lines on a Unix socket and
+// runs them in a pool of pre-forked workers, restarting any worker that dies. Each request
+// is a FRAME_LINE; the reply is FRAME_STDOUT/FRAME_STDERR chunks and a FRAME_EXIT status.
+int serveCommands(const char* path, int workerCount) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("shell24: socket path too long: %s\n", path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path); // A socket left behind by an earlier daemon
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+        perror(path);
+        return 1;
+    }
 
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleServeStop; // No SA_RESTART: the wait below has to return
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
 
-        // Continue with other command processing...
-        char* formatInput = formatCommandArguments(ipvar); // Format the input command
-        char *tkn[150]; // Array to hold tokens
-        int tokenCount = partitionCommandArguments(formatInput, tkn); // Split formatted input into tokens
+    pid_t* workers = memCalloc(MEM_SERVER, workerCount, sizeof(pid_t));
+    for (int i = 0; i < workerCount; i++) {
+        workers[i] = startServeWorker(listenFd);
+    }
+    printf("shell24: serving on %s with %d workers\n", path, workerCount);
+    fflush(stdout);
 
-        // Validate command and argument counts
-        int validIs = validateArgsAndSpecialChars(tkn, tokenCount);
-        if (validIs) {
-            processCommandTokens(tkn, tokenCount); // Execute the command if valid
+    while (!serveStopping) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < workerCount; i++) {
+            if (workers[i] == pid && !serveStopping) workers[i] = startServeWorker(listenFd);
         }
+    }
 
-        // Free allocated memory at the end of each loop iteration
-        free(ipvar);
-        free(formatInput);
-        // Remember to free other dynamically allocated memory as needed
+    for (int i = 0; i < workerCount; i++) {
+        if (workers[i] > 0) kill(workers[i], SIGTERM);
     }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) ;
+    unlink(path);
+    memFree(workers);
     return 0;
 }
+
+// Reads and runs lines until the input ends; also the main loop of every 'newt' session.
+// Returns the exit status of the last line run, or status when there was none.
+int runShellLoop(LineReader* reader, int interactive, int status) {
+    while (1) {
+        if (interactive) {
+            notifyFinishedJobs(1); // Report background jobs that finished since the last prompt
+            fflush(stdout);  // Ensure stdout is flushed before printing prompt
+            printf("shell24$ "); // Display the shell prompt
+            fflush(stdout);
+        }
+
+        char* ipvar = readLine(reader); // Read the next line, whatever its length
+        if (ipvar == NULL) {
+            if (interactive) printf("\n");
+            break; // End of input
+        }
+        if (interactive) {
+            ipvar = expandHistory(ipvar);
+            if (ipvar == NULL) continue;
+            recordHistory(ipvar);
+        }
+        reapJobs(); // Costs nothing unless a child changed state
+        status = executeLine(ipvar);
+    }
+    fflush(stdout);
+    return status;
+}
+
+// Entry point for the shell program.
+// Usage: shell24 [script | -c 'command line' | --serve SOCKET [--workers N]]; without
+// arguments commands come from stdin, and the prompt is only shown when stdin is a terminal.
+int main(int argc, char** argv) {
+    // SHELL24_LAUNCH=fork selects the fork()+execvp() path, e.g. to compare launch latency
+    char* launchEnv = getenv("SHELL24_LAUNCH");
+    if (launchEnv && strcmp(launchEnv, "fork") == 0) {
+        launchMode = LAUNCH_FORK;
+    }
+
+    // SHELL24_TRACE=FILE appends one JSON line per finished command to FILE
+    char* traceEnv = getenv("SHELL24_TRACE");
+    if (traceEnv && *traceEnv) {
+        traceFile = fopen(traceEnv, "ae");
+        if (traceFile) {
+            setvbuf(traceFile, NULL, _IOLBF, 0); // One write per line, also from forked children
+        } else {
+            perror(traceEnv);
+        }
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        if (argc < 3) {
+            printf("shell24: --serve requires a socket path\n");
+            return 2;
+        }
+        long workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (argc > 4 && strcmp(argv[3], "--workers") == 0) {
+            workers = atol(argv[4]);
+        }
+        initJobControl(0);
+        return serveCommands(argv[2], workers > 0 ? (int)workers : 1);
+    }
+
+    LineReader reader;
+    int interactive = 0, status = 0;
+    fstat(STDIN_FILENO, &shellStdin);
+    initJobControl(argc == 1 && isatty(STDIN_FILENO));
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        initLineReader(&reader, -1, argv[2], strlen(argv[2]));
+    } else if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        printf("shell24: -c requires an argument\n");
+        return 2;
+    } else if (argc > 1) {
+        if (openScriptReader(&reader, argv[1]) < 0) {
+            return 127;
+        }
+        // '#' is the concatenation operator, so a '#!' interpreter line has to be skipped
+        char* first = readLine(&reader);
+        if (first && strncmp(first, "#!", 2) != 0) {
+            status = executeLine(first);
+        }
+    } else {
+        initLineReader(&reader, STDIN_FILENO, NULL, 0);
+        interactive = isatty(STDIN_FILENO);
+        reader.reapWhileWaiting = interactive;
+    }
+
+    return runShellLoop(&reader, interactive, status);
+}